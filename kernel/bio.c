@@ -1,6 +1,6 @@
 // Buffer cache.
 //
-// The buffer cache is a linked list of buf structures holding
+// The buffer cache is a hash table of buf structures holding
 // cached copies of disk block contents.  Caching disk blocks
 // in memory reduces the number of disk reads and also provides
 // a synchronization point for disk blocks used by multiple processes.
@@ -12,6 +12,7 @@
 // * Do not use the buffer after calling brelse.
 // * Only one process at a time can use a buffer,
 //     so do not keep them longer than necessary.
+// * File data is written back later: see bdirty().
 
 
 #include "types.h"
@@ -23,33 +24,220 @@
 #include "fs.h"
 #include "buf.h"
 
+#define RA_BATCH 8   // read-ahead blocks per iosched_submit()
+#define SCAN 16      // unused buffers find_victim() compares
+#define WB_BATCH 16  // write-back blocks per iosched_submit()
+#define DIRTYFRAC 8  // bflush wakes early with 1/DIRTYFRAC of bufs dirty
+
+#define BHASH(dev, blockno) (((dev) * 31 + (blockno)) % bcache.nbucket)
+
+int nbuf;            // number of buffers, set by binit()
+uint bsize = DEFBSIZE; // block size (BSIZE), set by bsetsize()
+
+// Buffers live in a hash table keyed on (dev, blockno), one
+// spin-lock per bucket, so lookups of unrelated blocks never
+// contend. A bucket lock protects the dev, blockno and refcnt
+// of the buffers on its list, as well as the list itself.
+//
+// bcache.lock only serializes recycling: a miss in bget()
+// takes it, re-checks its bucket, then evicts an unused buffer.
+// Since only the holder of bcache.lock ever holds two bucket
+// locks at once, bucket locks can be taken in any order.
+//
+// binit() sizes the cache to 1/BCACHEFRAC of free memory, but
+// at least NBUF buffers, and allocates the bufs, the buckets
+// (about four bufs each) and the block data at boot. Blocks are
+// DEFBSIZE bytes until fsinit() finds the file system's block
+// size and calls bsetsize(), which re-carves the same memory.
+struct bucket {
+  struct spinlock lock;
+  struct buf head;     // circular list through prev/next
+};
+
 struct {
   struct spinlock lock;
-  struct buf buf[NBUF];
+  struct buf *buf;     // nbuf of them
+  int hand;            // where find_victim() resumes
+  struct bucket *bucket;
+  int nbucket;
 
-  // Linked list of all buffers, through prev/next.
-  // Sorted by how recently the buffer was used.
-  // head.next is most recent, head.prev is least.
-  struct buf head;
+  // write-back of file data.
+  struct spinlock dlock; // protects the fields below and b->ordered
+  struct buf *ordered;   // list through onext
+  int ndirty;            // dirty bufs
+  int flushwant;         // too many dirty bufs; bflush should run
 } bcache;
 
+static void
+bucket_remove(struct buf *b)
+{
+  b->next->prev = b->prev;
+  b->prev->next = b->next;
+}
+
+static void
+bucket_insert(int h, struct buf *b)
+{
+  struct buf *head = &bcache.bucket[h].head;
+
+  b->next = head->next;
+  b->prev = head;
+  head->next->prev = b;
+  head->next = b;
+}
+
+// Allocate a zeroed, physically contiguous array of at most
+// n elements of size sz from kalloc_pages(). Sets *n to the
+// number that fit.
+static void*
+alloc_array(int *n, uint sz)
+{
+  void *a;
+  int order;
+
+  for(order = 0; order < MAXORDER-1 && ((uint64)PGSIZE << order) < (uint64)*n * sz; order++)
+    ;
+  if((a = kalloc_pages(order)) == 0)
+    panic("binit: out of memory");
+  memset(a, 0, PGSIZE << order);
+  if((uint64)*n * sz > ((uint64)PGSIZE << order))
+    *n = (PGSIZE << order) / sz;
+  return a;
+}
+
+// Set up n bufs, for the cache or for private use outside it
+// (e.g. by the log), giving each one a block of data from
+// fresh pages.
+void
+bufinit(struct buf *bs, int n, uint dev)
+{
+  char *pg = 0;
+  int i;
+
+  for(i = 0; i < n; i++){
+    if(i % (PGSIZE/BSIZE) == 0 && (pg = kalloc()) == 0)
+      panic("bufinit: out of memory");
+    initsleeplock(&bs[i].lock, "buffer");
+    bs[i].dev = dev;
+    bs[i].data = (uchar*)pg + (i % (PGSIZE/BSIZE)) * BSIZE;
+  }
+}
+
 void
 binit(void)
 {
-  struct buf *b;
+  int i;
 
   initlock(&bcache.lock, "bcache");
+  initlock(&bcache.dlock, "bcache.dirty");
+
+  nbuf = buddy_nfree() * (PGSIZE/BSIZE) / BCACHEFRAC;
+  if(nbuf < NBUF)
+    nbuf = NBUF;
+  bcache.buf = alloc_array(&nbuf, sizeof(struct buf));
+  bcache.nbucket = (nbuf / 4) | 1;
+  bcache.bucket = alloc_array(&bcache.nbucket, sizeof(struct bucket));
+
+  for(i = 0; i < bcache.nbucket; i++){
+    initlock(&bcache.bucket[i].lock, "bcache.bucket");
+    bcache.bucket[i].head.prev = &bcache.bucket[i].head;
+    bcache.bucket[i].head.next = &bcache.bucket[i].head;
+  }
+
+  // All buffers start out as block 0 of device 0, in that
+  // block's bucket; they migrate to the right bucket when they
+  // are first recycled.
+  bufinit(bcache.buf, nbuf, 0);
+  for(i = 0; i < nbuf; i++)
+    bucket_insert(BHASH(0, 0), &bcache.buf[i]);
+}
+
+// Switch the cache to blocks of size bytes, a power of two
+// no bigger than a page, dropping everything cached. Called
+// once, by fsinit(), when no buffer is in use. The number of
+// buffers changes so that the cache keeps the same memory.
+void
+bsetsize(uint size)
+{
+  struct buf *b;
+  int i;
 
-  // Create linked list of buffers
-  bcache.head.prev = &bcache.head;
-  bcache.head.next = &bcache.head;
-  for(b = bcache.buf; b < bcache.buf+NBUF; b++){
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
-    initsleeplock(&b->lock, "buffer");
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
+  acquire(&bcache.lock);
+  for(i = 0; i < nbuf; i++){
+    b = &bcache.buf[i];
+    if(b->refcnt != 0 || b->disk)
+      panic("bsetsize: busy");
+    if(i % (PGSIZE/BSIZE) == 0)
+      kfree(b->data);
+  }
+  for(i = 0; i < bcache.nbucket; i++){
+    bcache.bucket[i].head.prev = &bcache.bucket[i].head;
+    bcache.bucket[i].head.next = &bcache.bucket[i].head;
+  }
+
+  nbuf = nbuf / (size / BSIZE);
+  bsize = size;
+  memset(bcache.buf, 0, nbuf * sizeof(struct buf));
+  bufinit(bcache.buf, nbuf, 0);
+  for(i = 0; i < nbuf; i++)
+    bucket_insert(BHASH(0, 0), &bcache.buf[i]);
+  bcache.hand = 0;
+  release(&bcache.lock);
+}
+
+// Look for block blockno on device dev in bucket h.
+// Caller holds the bucket lock.
+static struct buf*
+bucket_lookup(int h, uint dev, uint blockno)
+{
+  struct buf *b, *head = &bcache.bucket[h].head;
+
+  for(b = head->next; b != head; b = b->next){
+    if(b->dev == dev && b->blockno == blockno)
+      return b;
   }
+  return 0;
+}
+
+// Pick an unused, clean buffer to recycle, and return it with its
+// bucket lock held (*hp is set to the bucket). Sweeps the
+// buffers like a clock hand and takes the one with the oldest
+// timestamp among the next SCAN unused ones, so the cost of a
+// miss does not grow with the size of the cache.
+// Caller holds bcache.lock, so no buffer changes bucket
+// during the sweep.
+static struct buf*
+find_victim(int *hp)
+{
+  struct buf *b, *best;
+  int i, h, besth, held, nfree;
+
+  best = 0;
+  besth = -1;
+  nfree = 0;
+  for(i = 0; i < nbuf && nfree < SCAN; i++){
+    b = &bcache.buf[bcache.hand];
+    bcache.hand = (bcache.hand + 1) % nbuf;
+    h = BHASH(b->dev, b->blockno);
+    held = (h == besth);
+    if(!held)
+      acquire(&bcache.bucket[h].lock);
+    if(b->refcnt == 0 && b->disk == 0 && b->dirty == 0){
+      nfree++;
+      if(best == 0 || b->lastuse < best->lastuse){
+        // keep holding the lock of the best candidate's bucket.
+        if(besth >= 0 && !held)
+          release(&bcache.bucket[besth].lock);
+        best = b;
+        besth = h;
+        continue;
+      }
+    }
+    if(!held)
+      release(&bcache.bucket[h].lock);
+  }
+  *hp = besth;
+  return best;
 }
 
 // Look through buffer cache for block on device dev.
@@ -59,33 +247,52 @@ static struct buf*
 bget(uint dev, uint blockno)
 {
   struct buf *b;
+  int h, vh;
 
-  acquire(&bcache.lock);
+  h = BHASH(dev, blockno);
+  acquire(&bcache.bucket[h].lock);
 
   // Is the block already cached?
-  for(b = bcache.head.next; b != &bcache.head; b = b->next){
-    if(b->dev == dev && b->blockno == blockno){
-      b->refcnt++;
-      release(&bcache.lock);
-      acquiresleep(&b->lock);
-      return b;
-    }
+  if((b = bucket_lookup(h, dev, blockno)) != 0){
+    b->refcnt++;
+    release(&bcache.bucket[h].lock);
+    acquiresleep(&b->lock);
+    return b;
   }
+  release(&bcache.bucket[h].lock);
 
   // Not cached.
+  acquire(&bcache.lock);
+
+  // Someone else may have cached it since we looked;
+  // only holders of bcache.lock add blocks to buckets.
+  acquire(&bcache.bucket[h].lock);
+  if((b = bucket_lookup(h, dev, blockno)) != 0){
+    b->refcnt++;
+    release(&bcache.bucket[h].lock);
+    release(&bcache.lock);
+    acquiresleep(&b->lock);
+    return b;
+  }
+  release(&bcache.bucket[h].lock);
+
   // Recycle the least recently used (LRU) unused buffer.
-  for(b = bcache.head.prev; b != &bcache.head; b = b->prev){
-    if(b->refcnt == 0) {
-      b->dev = dev;
-      b->blockno = blockno;
-      b->valid = 0;
-      b->refcnt = 1;
-      release(&bcache.lock);
-      acquiresleep(&b->lock);
-      return b;
-    }
+  if((b = find_victim(&vh)) == 0)
+    panic("bget: no buffers");
+  b->dev = dev;
+  b->blockno = blockno;
+  b->valid = 0;
+  b->refcnt = 1;
+  if(vh != h){
+    bucket_remove(b);
+    release(&bcache.bucket[vh].lock);
+    acquire(&bcache.bucket[h].lock);
+    bucket_insert(h, b);
   }
-  panic("bget: no buffers");
+  release(&bcache.bucket[h].lock);
+  release(&bcache.lock);
+  acquiresleep(&b->lock);
+  return b;
 }
 
 // Return a locked buf with the contents of the indicated block.
@@ -96,58 +303,383 @@ bread(uint dev, uint blockno)
 
   b = bget(dev, blockno);
   if(!b->valid) {
-    virtio_disk_rw(b, 0);
+    if(b->disk)
+      virtio_disk_wait(b);  // read-ahead already in flight
+    else
+      iosched_rw(b, 0);
     b->valid = 1;
   }
   return b;
 }
 
+// Claim a buffer for an asynchronous read of blockno, unless
+// the block is already cached or no buffer is free. The buffer
+// is left unlocked and unreferenced; b->disk keeps it from being
+// recycled until the read completes, and a bread() that finds it
+// meanwhile waits for the read rather than issuing another.
+static struct buf*
+bget_ahead(uint dev, uint blockno)
+{
+  struct buf *b;
+  int h, vh;
+
+  h = BHASH(dev, blockno);
+  acquire(&bcache.bucket[h].lock);
+  b = bucket_lookup(h, dev, blockno);
+  release(&bcache.bucket[h].lock);
+  if(b)
+    return 0;
+
+  acquire(&bcache.lock);
+  acquire(&bcache.bucket[h].lock);
+  b = bucket_lookup(h, dev, blockno);
+  release(&bcache.bucket[h].lock);
+  if(b || (b = find_victim(&vh)) == 0){
+    release(&bcache.lock);
+    return 0;
+  }
+  b->dev = dev;
+  b->blockno = blockno;
+  b->valid = 0;
+  b->disk = 1;           // reserve it for the read
+  b->lastuse = ticks;    // don't recycle it before it is used
+  if(vh != h){
+    bucket_remove(b);
+    release(&bcache.bucket[vh].lock);
+    acquire(&bcache.bucket[h].lock);
+    bucket_insert(h, b);
+  }
+  release(&bcache.bucket[h].lock);
+  release(&bcache.lock);
+  return b;
+}
+
+// Start reading the n blocks in blocknos into the cache,
+// without waiting for the disk. Blocks already cached are
+// skipped.
+void
+breadahead(uint dev, uint *blocknos, int n)
+{
+  struct buf *bs[RA_BATCH];
+  int i, k;
+
+  k = 0;
+  for(i = 0; i < n; i++){
+    if((bs[k] = bget_ahead(dev, blocknos[i])) != 0)
+      k++;
+    if(k == RA_BATCH){
+      iosched_submit(bs, k, 0);
+      k = 0;
+    }
+  }
+  if(k > 0)
+    iosched_submit(bs, k, 0);
+}
+
 // Write b's contents to disk.  Must be locked.
 void
 bwrite(struct buf *b)
 {
   if(!holdingsleep(&b->lock))
     panic("bwrite");
-  virtio_disk_rw(b, 1);
+  iosched_rw(b, 1);
+}
+
+// Write the contents of n locked bufs to disk, with all of
+// them in flight at once, and wait for them all.
+void
+bwrite_batch(struct buf **bs, int n)
+{
+  int i;
+
+  for(i = 0; i < n; i++)
+    if(!holdingsleep(&bs[i]->lock))
+      panic("bwrite_batch");
+  iosched_submit(bs, n, 1);
+  for(i = 0; i < n; i++)
+    virtio_disk_wait(bs[i]);
 }
 
 // Release a locked buffer.
-// Move to the head of the most-recently-used list.
+// Stamp it so that recycling can find the least recently used.
 void
 brelse(struct buf *b)
 {
+  int h;
+
   if(!holdingsleep(&b->lock))
     panic("brelse");
 
   releasesleep(&b->lock);
 
-  acquire(&bcache.lock);
+  h = BHASH(b->dev, b->blockno);
+  acquire(&bcache.bucket[h].lock);
   b->refcnt--;
   if (b->refcnt == 0) {
     // no one is waiting for it.
-    b->next->prev = b->prev;
-    b->prev->next = b->next;
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
-  }
-  
-  release(&bcache.lock);
+    b->lastuse = ticks;
+  }
+  release(&bcache.bucket[h].lock);
 }
 
 void
 bpin(struct buf *b) {
-  acquire(&bcache.lock);
+  int h = BHASH(b->dev, b->blockno);
+
+  acquire(&bcache.bucket[h].lock);
   b->refcnt++;
-  release(&bcache.lock);
+  b->pin++;
+  release(&bcache.bucket[h].lock);
 }
 
 void
 bunpin(struct buf *b) {
-  acquire(&bcache.lock);
+  int h = BHASH(b->dev, b->blockno);
+
+  acquire(&bcache.bucket[h].lock);
   b->refcnt--;
-  release(&bcache.lock);
+  b->pin--;
+  release(&bcache.bucket[h].lock);
+}
+
+// Does the log hold a copy of locked buffer b that has not been
+// installed yet? Installing it would overwrite anything written
+// to the block directly, so b's later changes must be logged
+// too. Pins are only added and dropped with b locked.
+int
+bpinned(struct buf *b)
+{
+  return b->pin > 0;
+}
+
+// Write-back of file data.
+//
+// File data does not go through the log (see dwrite() in fs.c):
+// bdirty() marks a buffer whose contents must still be written
+// to its block, and find_victim() passes it over until that is
+// done. The bflush kernel thread writes dirty buffers back every
+// FLUSHDELAY ticks, or sooner once 1/DIRTYFRAC of the cache is
+// dirty. Buffers of blocks just added to files also go on the
+// ordered list; the log writes those back before each commit,
+// so that a committed inode never covers blocks holding stale
+// contents.
+
+// Return a locked buffer for blockno, zeroed, without reading
+// the block: the caller is about to overwrite it.
+struct buf*
+bnew(uint dev, uint blockno)
+{
+  struct buf *b;
+
+  b = bget(dev, blockno);
+  if(!b->valid && b->disk)
+    virtio_disk_wait(b);  // read-ahead in flight
+  memset(b->data, 0, BSIZE);
+  b->valid = 1;
+  return b;
+}
+
+// Caller has modified locked buffer b, and it is to be written
+// back later rather than logged.
+void
+bdirty(struct buf *b)
+{
+  if(b->dirty)
+    return;
+  b->dirty = 1;
+  acquire(&bcache.dlock);
+  bcache.ndirty++;
+  if(bcache.ndirty > nbuf/DIRTYFRAC)
+    bcache.flushwant = 1;
+  release(&bcache.dlock);
+}
+
+// Locked buffer b has been written, or the log has taken it
+// over: it no longer needs writing back.
+void
+bclean(struct buf *b)
+{
+  if(!b->dirty)
+    return;
+  b->dirty = 0;
+  acquire(&bcache.dlock);
+  bcache.ndirty--;
+  release(&bcache.dlock);
+}
+
+// Locked, dirty buffer b must be written back before the next
+// commit. The ordered list holds a reference to it.
+void
+bordered(struct buf *b)
+{
+  int h = BHASH(b->dev, b->blockno);
+
+  acquire(&bcache.dlock);
+  if(!b->ordered){
+    b->ordered = 1;
+    b->onext = bcache.ordered;
+    bcache.ordered = b;
+    acquire(&bcache.bucket[h].lock);
+    b->refcnt++;
+    release(&bcache.bucket[h].lock);
+  }
+  release(&bcache.dlock);
+}
+
+// Write locked bufs back and release them.
+static void
+bwriteback_locked(struct buf **bs, int n)
+{
+  int i;
+
+  bwrite_batch(bs, n);
+  for(i = 0; i < n; i++){
+    bclean(bs[i]);
+    brelse(bs[i]);
+  }
+}
+
+// Write back those of the n referenced, unlocked bufs in bs
+// that are dirty, WB_BATCH at a time, and drop the references.
+// Never waits for a buffer's lock while holding others, since
+// their holders might be waiting for those.
+static void
+bwriteback(struct buf **bs, int n)
+{
+  struct buf *b, *w[WB_BATCH];
+  int i, k;
+
+  k = 0;
+  for(i = 0; i < n; i++){
+    b = bs[i];
+    if(k == 0){
+      acquiresleep(&b->lock);
+    } else if(!tryacquiresleep(&b->lock)){
+      bwriteback_locked(w, k);
+      k = 0;
+      acquiresleep(&b->lock);
+    }
+    if(!b->dirty){
+      brelse(b);
+      continue;
+    }
+    w[k++] = b;
+    if(k == WB_BATCH){
+      bwriteback_locked(w, k);
+      k = 0;
+    }
+  }
+  if(k > 0)
+    bwriteback_locked(w, k);
+}
+
+// Write back every dirty buffer.
+void
+bflush(void)
+{
+  struct buf *b, *bs[WB_BATCH];
+  int i, n, h;
+
+  for(i = 0; i < nbuf; ){
+    // reference a batch; holding bcache.lock, no buffer
+    // changes block meanwhile.
+    n = 0;
+    acquire(&bcache.lock);
+    for(; i < nbuf && n < WB_BATCH; i++){
+      b = &bcache.buf[i];
+      if(!b->dirty)
+        continue;
+      h = BHASH(b->dev, b->blockno);
+      acquire(&bcache.bucket[h].lock);
+      b->refcnt++;
+      release(&bcache.bucket[h].lock);
+      bs[n++] = b;
+    }
+    release(&bcache.lock);
+    bwriteback(bs, n);
+  }
+}
+
+// Write back the buffers on the ordered list.
+// Called by the log before it commits.
+void
+bflush_ordered(void)
+{
+  struct buf *b, *bs[WB_BATCH];
+  int n;
+
+  acquire(&bcache.dlock);
+  while(bcache.ordered){
+    for(n = 0; n < WB_BATCH && (b = bcache.ordered) != 0; n++){
+      bcache.ordered = b->onext;
+      b->ordered = 0;
+      bs[n] = b;
+    }
+    release(&bcache.dlock);
+    bwriteback(bs, n);
+    acquire(&bcache.dlock);
+  }
+  release(&bcache.dlock);
+}
+
+// Write back those of the n blocks in blocknos that are cached
+// and dirty. For fsync().
+void
+bsync(uint dev, uint *blocknos, int n)
+{
+  struct buf *b, *bs[WB_BATCH];
+  int i, k, h;
+
+  k = 0;
+  for(i = 0; i < n; i++){
+    h = BHASH(dev, blocknos[i]);
+    acquire(&bcache.bucket[h].lock);
+    if((b = bucket_lookup(h, dev, blocknos[i])) != 0 && b->dirty){
+      b->refcnt++;
+      bs[k++] = b;
+    }
+    release(&bcache.bucket[h].lock);
+    if(k == WB_BATCH){
+      bwriteback(bs, k);
+      k = 0;
+    }
+  }
+  if(k > 0)
+    bwriteback(bs, k);
 }
 
+// Called by writers outside FS operations: if they have dirtied
+// more of the cache than bflush keeps up with, write back before
+// dirtying more, so that the cache never fills with dirty bufs.
+void
+bthrottle(void)
+{
+  if(bcache.ndirty > 2*nbuf/DIRTYFRAC)
+    bflush();
+}
 
+// The bflush kernel thread.
+static void
+bflusher(void)
+{
+  uint t0;
+
+  for(;;){
+    acquire(&tickslock);
+    t0 = ticks;
+    while(ticks - t0 < FLUSHDELAY && !bcache.flushwant)
+      sleep(&ticks, &tickslock);
+    release(&tickslock);
+    acquire(&bcache.dlock);
+    bcache.flushwant = 0;
+    release(&bcache.dlock);
+    bflush();
+  }
+}
+
+void
+bflushinit(void)
+{
+  if(kthread(bflusher, "bflush") < 0)
+    panic("bflushinit");
+}
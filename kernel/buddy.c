@@ -0,0 +1,232 @@
+// Buddy allocator for physically contiguous runs of pages.
+//
+// Physical memory between the end of the kernel and PHYSTOP is
+// managed as blocks of 2^order pages, 0 <= order < MAXORDER.
+// A block of order k starts at a page index (counted from
+// KERNBASE) that is a multiple of 2^k, and its buddy is the
+// block whose index differs only in bit k. Freeing a block
+// merges it with its buddy whenever the buddy is also free,
+// so memory returns to large blocks instead of fragmenting.
+//
+// kalloc() and kfree() in kalloc.c sit on top of this: their
+// per-CPU caches refill from and drain to the order-0 pool
+// here with buddy_take() and buddy_give().
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "spinlock.h"
+#include "riscv.h"
+#include "defs.h"
+
+#define NPAGE     ((PHYSTOP - KERNBASE) / PGSIZE)
+#define PA2IDX(pa) (((uint64)(pa) - KERNBASE) / PGSIZE)
+#define IDX2PA(i)  ((void*)(KERNBASE + (uint64)(i) * PGSIZE))
+
+// pginfo[i] describes the page with index i.
+// BFREE|order if i is the first page of a free block, else 0.
+#define BFREE 0x80
+
+// free blocks are kept on doubly linked lists, one per order,
+// threaded through the first bytes of the free block itself.
+struct bnode {
+  struct bnode *next;
+  struct bnode *prev;
+};
+
+struct {
+  struct spinlock lock;
+  uint64 lo, hi;                 // managed page indices [lo, hi)
+  struct bnode free[MAXORDER];   // list heads
+  int nfree[MAXORDER];           // # of free blocks per order
+  uchar pginfo[NPAGE];
+} buddy;
+
+static void
+list_push(int order, uint64 i)
+{
+  struct bnode *n = IDX2PA(i);
+  struct bnode *h = &buddy.free[order];
+
+  n->next = h->next;
+  n->prev = h;
+  h->next->prev = n;
+  h->next = n;
+  buddy.pginfo[i] = BFREE | order;
+  buddy.nfree[order]++;
+}
+
+static void
+list_remove(int order, uint64 i)
+{
+  struct bnode *n = IDX2PA(i);
+
+  n->prev->next = n->next;
+  n->next->prev = n->prev;
+  buddy.pginfo[i] = 0;
+  buddy.nfree[order]--;
+}
+
+// Free the block of 2^order pages at index i, merging with
+// its buddies. Caller holds buddy.lock.
+static void
+merge_free(uint64 i, int order)
+{
+  uint64 b;
+
+  if(buddy.pginfo[i] & BFREE)
+    panic("buddy: double free");
+  while(order < MAXORDER-1){
+    b = i ^ (1L << order);
+    if(b < buddy.lo || b >= buddy.hi || buddy.pginfo[b] != (BFREE | order))
+      break;
+    list_remove(order, b);
+    if(b < i)
+      i = b;
+    order++;
+  }
+  list_push(order, i);
+}
+
+// Allocate a block of 2^order pages, splitting a larger
+// block if need be. Returns its index, or -1.
+// Caller holds buddy.lock.
+static long
+split_alloc(int order)
+{
+  int k;
+  uint64 i;
+
+  for(k = order; k < MAXORDER; k++)
+    if(buddy.free[k].next != &buddy.free[k])
+      break;
+  if(k == MAXORDER)
+    return -1;
+
+  i = PA2IDX(buddy.free[k].next);
+  list_remove(k, i);
+  while(k > order){
+    // keep the lower half, free the upper half.
+    k--;
+    list_push(k, i + (1L << k));
+  }
+  return i;
+}
+
+void
+buddyinit(void *pa_start, void *pa_end)
+{
+  uint64 i;
+
+  initlock(&buddy.lock, "buddy");
+  for(int k = 0; k < MAXORDER; k++){
+    buddy.free[k].next = buddy.free[k].prev = &buddy.free[k];
+    buddy.nfree[k] = 0;
+  }
+  buddy.lo = PA2IDX(PGROUNDUP((uint64)pa_start));
+  buddy.hi = PA2IDX(PGROUNDDOWN((uint64)pa_end));
+
+  acquire(&buddy.lock);
+  for(i = buddy.lo; i < buddy.hi; i++){
+    memset(IDX2PA(i), 1, PGSIZE);
+    merge_free(i, 0);
+  }
+  release(&buddy.lock);
+}
+
+// Allocate 2^order physically contiguous pages.
+// Returns a pointer that the kernel can use.
+// Returns 0 if no run that large is free.
+void*
+kalloc_pages(int order)
+{
+  long i;
+
+  if(order < 0 || order >= MAXORDER)
+    return 0;
+
+  acquire(&buddy.lock);
+  i = split_alloc(order);
+  release(&buddy.lock);
+
+  if(i < 0 && order > 0){
+    // free pages parked in the per-CPU caches may be
+    // exactly the buddies we need; give them back and retry.
+    kmem_flush();
+    acquire(&buddy.lock);
+    i = split_alloc(order);
+    release(&buddy.lock);
+  }
+  if(i < 0)
+    return 0;
+
+  memset(IDX2PA(i), 5, PGSIZE << order); // fill with junk
+  return IDX2PA(i);
+}
+
+// Free 2^order pages returned by kalloc_pages(order).
+void
+kfree_pages(void *pa, int order)
+{
+  uint64 i = PA2IDX(pa);
+
+  if(((uint64)pa % PGSIZE) != 0 || order < 0 || order >= MAXORDER ||
+     i < buddy.lo || i + (1L << order) > buddy.hi || (i & ((1L << order) - 1)))
+    panic("kfree_pages");
+
+  // Fill with junk to catch dangling refs.
+  memset(pa, 1, PGSIZE << order);
+
+  acquire(&buddy.lock);
+  merge_free(i, order);
+  release(&buddy.lock);
+}
+
+// Number of free pages, for sizing allocations made at boot.
+uint64
+buddy_nfree(void)
+{
+  uint64 n = 0;
+
+  acquire(&buddy.lock);
+  for(int k = 0; k < MAXORDER; k++)
+    n += (uint64)buddy.nfree[k] << k;
+  release(&buddy.lock);
+  return n;
+}
+
+// Take up to n single pages under one acquisition of the lock,
+// for kalloc()'s per-CPU caches. The pages are returned as a
+// list linked through their first word; *got is set to the
+// number taken. No junk fill: kalloc() does that.
+void*
+buddy_take(int n, int *got)
+{
+  void *head = 0;
+  long i;
+
+  *got = 0;
+  acquire(&buddy.lock);
+  while(*got < n && (i = split_alloc(0)) >= 0){
+    *(void**)IDX2PA(i) = head;
+    head = IDX2PA(i);
+    (*got)++;
+  }
+  release(&buddy.lock);
+  return head;
+}
+
+// Return a list of single pages, linked through their first
+// word as buddy_take() hands them out.
+void
+buddy_give(void *head)
+{
+  void *next;
+
+  acquire(&buddy.lock);
+  for(; head; head = next){
+    next = *(void**)head;
+    merge_free(PA2IDX(head), 0);
+  }
+  release(&buddy.lock);
+}
@@ -5,8 +5,15 @@ struct buf {
   uint blockno;
   struct sleeplock lock;
   uint refcnt;
-  struct buf *prev; // LRU cache list
+  uint lastuse;     // ticks when refcnt last fell to zero
+  struct buf *prev; // hash bucket list
   struct buf *next;
-  uchar data[BSIZE];
+  struct buf *qnext; // I/O scheduler queue, in-flight request
+  int qwrite;        // queued for write (vs read)?
+  int pin;           // log copies not yet installed
+  int dirty;         // file data to write back, not logged
+  int ordered;       // on the ordered list (see bordered())
+  struct buf *onext; // ordered list
+  uchar *data;       // BSIZE bytes
 };
 
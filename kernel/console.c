@@ -138,8 +138,10 @@ consoleintr(int c)
   acquire(&cons.lock);
 
   switch(c){
-  case C('P'):  // Print process list.
+  case C('P'):  // Print process list, object caches, log stats.
     procdump();
+    kmem_cache_dump();
+    log_dump();
     break;
   case C('U'):  // Kill line.
     while(cons.e != cons.w &&
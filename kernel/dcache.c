@@ -0,0 +1,184 @@
+// Directory name lookup cache.
+//
+// Remembers the result of looking up a name in a directory,
+// (dev, directory inum, name) -> inum, so that namex() can
+// resolve hot paths without locking and reading directories.
+// Inum 0 records that the name does not exist.
+//
+// Entries are added by namex() while it holds the directory
+// locked, after dirlookup(), and dropped by dirlink() and
+// sys_unlink() while they hold it locked, so an entry always
+// agrees with the directory. Entries of a directory, and for an
+// inode, are purged when the inode is freed, since its inum may
+// then be reused.
+//
+// Each entry in the NDENTRY array is on a hash chain while in
+// use; a clock hand picks entries to recycle.
+
+#include "types.h"
+#include "param.h"
+#include "spinlock.h"
+#include "riscv.h"
+#include "defs.h"
+#include "fs.h"
+
+#define NDHASH 61
+
+struct dentry {
+  uint dev;
+  uint dinum;           // directory
+  char name[DIRSIZ];
+  uint inum;            // 0 if name is known not to exist
+  int used;
+  int ref;              // looked up since the hand last passed
+  struct dentry *next;  // hash chain
+};
+
+struct {
+  struct spinlock lock;
+  struct dentry d[NDENTRY];
+  struct dentry *hash[NDHASH];
+  int hand;
+} dcache;
+
+static uint
+dhash(uint dev, uint dinum, char *name)
+{
+  uint h = dev * 31 + dinum;
+  int i;
+
+  for(i = 0; i < DIRSIZ && name[i]; i++)
+    h = h * 31 + (uchar)name[i];
+  return h % NDHASH;
+}
+
+void
+dcacheinit(void)
+{
+  initlock(&dcache.lock, "dcache");
+}
+
+// Caller holds dcache.lock.
+static struct dentry*
+dfind(uint dev, uint dinum, char *name)
+{
+  struct dentry *d;
+
+  for(d = dcache.hash[dhash(dev, dinum, name)]; d; d = d->next)
+    if(d->dev == dev && d->dinum == dinum && namecmp(name, d->name) == 0)
+      return d;
+  return 0;
+}
+
+// Take d off its hash chain and free it.
+// Caller holds dcache.lock.
+static void
+ddrop(struct dentry *d)
+{
+  struct dentry **pp;
+
+  for(pp = &dcache.hash[dhash(d->dev, d->dinum, d->name)]; *pp != d; pp = &(*pp)->next)
+    ;
+  *pp = d->next;
+  d->used = 0;
+}
+
+// Look up name in directory dinum. On a hit, returns 1 and sets
+// *ipp to the inode, referenced as by iget(), or to 0 if the name
+// does not exist. Returns 0 on a miss.
+// Must be called inside a transaction since it may call iput().
+int
+dcache_lookup(uint dev, uint dinum, char *name, struct inode **ipp)
+{
+  struct dentry *d;
+  struct inode *ip;
+  uint inum;
+  int same;
+
+  acquire(&dcache.lock);
+  if((d = dfind(dev, dinum, name)) == 0){
+    release(&dcache.lock);
+    return 0;
+  }
+  d->ref = 1;
+  inum = d->inum;
+  release(&dcache.lock);
+  if(inum == 0){
+    *ipp = 0;
+    return 1;
+  }
+
+  // iget() takes the inode table's locks, so call it without
+  // dcache.lock, and then check that the name still refers to
+  // the inode: meanwhile it may have been freed and its inum
+  // reused. Once the reference is taken that can't happen.
+  ip = iget(dev, inum);
+  acquire(&dcache.lock);
+  d = dfind(dev, dinum, name);
+  same = d != 0 && d->inum == inum;
+  release(&dcache.lock);
+  if(!same){
+    iput(ip);
+    return 0;
+  }
+  *ipp = ip;
+  return 1;
+}
+
+// Record that name in directory dinum is inum (0: no such name).
+// Caller holds the directory locked.
+void
+dcache_enter(uint dev, uint dinum, char *name, uint inum)
+{
+  struct dentry *d;
+  uint h;
+
+  acquire(&dcache.lock);
+  if((d = dfind(dev, dinum, name)) == 0){
+    for(;;){
+      d = &dcache.d[dcache.hand];
+      dcache.hand = (dcache.hand + 1) % NDENTRY;
+      if(!d->used || !d->ref)
+        break;
+      d->ref = 0;
+    }
+    if(d->used)
+      ddrop(d);
+    d->dev = dev;
+    d->dinum = dinum;
+    strncpy(d->name, name, DIRSIZ);
+    d->used = 1;
+    h = dhash(dev, dinum, name);
+    d->next = dcache.hash[h];
+    dcache.hash[h] = d;
+  }
+  d->inum = inum;
+  d->ref = 1;
+  release(&dcache.lock);
+}
+
+// Forget name in directory dinum.
+// Caller holds the directory locked.
+void
+dcache_remove(uint dev, uint dinum, char *name)
+{
+  struct dentry *d;
+
+  acquire(&dcache.lock);
+  if((d = dfind(dev, dinum, name)) != 0)
+    ddrop(d);
+  release(&dcache.lock);
+}
+
+// Forget the names in directory inum, and those naming inum.
+void
+dcache_purge(uint dev, uint inum)
+{
+  struct dentry *d;
+
+  acquire(&dcache.lock);
+  for(d = dcache.d; d < &dcache.d[NDENTRY]; d++)
+    if(d->used && d->dev == dev && (d->dinum == inum || d->inum == inum))
+      ddrop(d);
+  release(&dcache.lock);
+}
@@ -1,6 +1,7 @@
 struct buf;
 struct context;
 struct file;
+struct kmem_cache;
 struct inode;
 struct pipe;
 struct proc;
@@ -16,6 +17,30 @@ void            brelse(struct buf*);
 void            bwrite(struct buf*);
 void            bpin(struct buf*);
 void            bunpin(struct buf*);
+void            breadahead(uint, uint*, int);
+void            bwrite_batch(struct buf**, int);
+void            bufinit(struct buf*, int, uint);
+void            bsetsize(uint);
+struct buf*     bnew(uint, uint);
+void            bdirty(struct buf*);
+void            bclean(struct buf*);
+int             bpinned(struct buf*);
+void            bordered(struct buf*);
+void            bflush(void);
+void            bflush_ordered(void);
+void            bsync(uint, uint*, int);
+void            bthrottle(void);
+void            bflushinit(void);
+extern int      nbuf;
+extern uint     bsize;
+
+// buddy.c
+void            buddyinit(void*, void*);
+void*           kalloc_pages(int);
+void            kfree_pages(void*, int);
+void*           buddy_take(int, int*);
+void            buddy_give(void*);
+uint64          buddy_nfree(void);
 
 // console.c
 void            consoleinit(void);
@@ -32,15 +57,28 @@ struct file*    filedup(struct file*);
 void            fileinit(void);
 int             fileread(struct file*, uint64, int n);
 int             filestat(struct file*, uint64 addr);
+int             filesync(struct file*);
+int             filesplice(struct file*, struct file*, int);
 int             filewrite(struct file*, uint64, int n);
 
+// dcache.c
+void            dcacheinit(void);
+int             dcache_lookup(uint, uint, char*, struct inode**);
+void            dcache_enter(uint, uint, char*, uint);
+void            dcache_remove(uint, uint, char*);
+void            dcache_purge(uint, uint);
+
 // fs.c
 void            fsinit(int);
+void            bfreecommit(uint);
 int             dirlink(struct inode*, char*, uint);
+int             dirop_blocks(void);
 struct inode*   dirlookup(struct inode*, char*, uint*);
 struct inode*   ialloc(uint, short);
 struct inode*   idup(struct inode*);
+struct inode*   iget(uint, uint);
 void            iinit();
+int             ishrink(void);
 void            ilock(struct inode*);
 void            iput(struct inode*);
 void            iunlock(struct inode*);
@@ -52,6 +90,7 @@ struct inode*   nameiparent(char*, char*);
 int             readi(struct inode*, int, uint64, uint, uint);
 void            stati(struct inode*, struct stat*);
 int             writei(struct inode*, int, uint64, uint, uint);
+int             ifsync(struct inode*);
 void            itrunc(struct inode*);
 
 // ramdisk.c
@@ -59,22 +98,44 @@ void            ramdiskinit(void);
 void            ramdiskintr(void);
 void            ramdiskrw(struct buf*);
 
+// iosched.c
+void            iosched_init(void);
+void            iosched_submit(struct buf**, int, int);
+void            iosched_rw(struct buf*, int);
+void            iosched_dispatch(void);
+
 // kalloc.c
 void*           kalloc(void);
+void*           kalloc_reclaim(void);
 void            kfree(void *);
 void            kinit(void);
+void            kmem_flush(void);
+void            kdup(void *);
+int             kshared(void *);
 
 // log.c
 void            initlog(int, struct superblock*);
 void            log_write(struct buf*);
+void            log_dump(void);
 void            begin_op(void);
 void            end_op(void);
+void            begin_opn(int);
+void            end_opn(int);
+int             log_maxop(void);
+uint            log_opseq(void);
 
 // pipe.c
+void            pipeinit(void);
 int             pipealloc(struct file**, struct file**);
 void            pipeclose(struct pipe*, int);
 int             piperead(struct pipe*, uint64, int);
 int             pipewrite(struct pipe*, uint64, int);
+int             pipegetsize(struct pipe*);
+int             pipesetsize(struct pipe*, int);
+int             pipe_wbegin(struct pipe*, char**, int);
+void            pipe_wend(struct pipe*, int);
+int             pipe_rbegin(struct pipe*, char**, int, int);
+void            pipe_rend(struct pipe*, int);
 
 // printf.c
 void            printf(char*, ...);
@@ -86,12 +147,15 @@ int             cpuid(void);
 void            exit(int);
 int             fork(void);
 int             growproc(int);
+int             kthread(void(*)(void), char*);
 void            proc_mapstacks(pagetable_t);
 pagetable_t     proc_pagetable(struct proc *);
 void            proc_freepagetable(pagetable_t, uint64);
 int             kill(int);
 int             killed(struct proc*);
 void            setkilled(struct proc*);
+int             nice(int);
+int             setpriority(int, int);
 struct cpu*     mycpu(void);
 struct cpu*     getmycpu(void);
 struct proc*    myproc();
@@ -102,6 +166,7 @@ void            sleep(void*, struct spinlock*);
 void            userinit(void);
 int             wait(uint64);
 void            wakeup(void*);
+void            wakeone(void*);
 void            yield(void);
 int             either_copyout(int user_dst, uint64 dst, void *src, uint64 len);
 int             either_copyin(void *dst, int user_src, uint64 src, uint64 len);
@@ -110,6 +175,14 @@ void            procdump(void);
 // swtch.S
 void            swtch(struct context*, struct context*);
 
+// slab.c
+void            kmem_cache_init(void);
+struct kmem_cache* kmem_cache_create(char*, uint, void (*)(void*));
+void*           kmem_cache_alloc(struct kmem_cache*);
+void            kmem_cache_free(struct kmem_cache*, void*);
+int             kmem_cache_reap(void);
+void            kmem_cache_dump(void);
+
 // spinlock.c
 void            acquire(struct spinlock*);
 int             holding(struct spinlock*);
@@ -120,6 +193,7 @@ void            pop_off(void);
 
 // sleeplock.c
 void            acquiresleep(struct sleeplock*);
+int             tryacquiresleep(struct sleeplock*);
 void            releasesleep(struct sleeplock*);
 int             holdingsleep(struct sleeplock*);
 void            initsleeplock(struct sleeplock*, char*);
@@ -170,6 +244,7 @@ void            uvmunmap(pagetable_t, uint64, uint64, int);
 void            uvmclear(pagetable_t, uint64);
 pte_t *         walk(pagetable_t, uint64, int);
 uint64          walkaddr(pagetable_t, uint64);
+int             uvmcow(pagetable_t, uint64);
 int             copyout(pagetable_t, uint64, char *, uint64);
 int             copyin(pagetable_t, char *, uint64, uint64);
 int             copyinstr(pagetable_t, char *, uint64, uint64);
@@ -182,7 +257,8 @@ void            plic_complete(int);
 
 // virtio_disk.c
 void            virtio_disk_init(void);
-void            virtio_disk_rw(struct buf *, int);
+int             virtio_disk_start(struct buf *, int, int);
+void            virtio_disk_wait(struct buf *);
 void            virtio_disk_intr(void);
 
 // number of elements in fixed-size array
@@ -16,13 +16,14 @@
 struct devsw devsw[NDEV];
 struct {
   struct spinlock lock;
-  struct file file[NFILE];
+  struct kmem_cache *cache;
 } ftable;
 
 void
 fileinit(void)
 {
   initlock(&ftable.lock, "ftable");
+  ftable.cache = kmem_cache_create("file", sizeof(struct file), 0);
 }
 
 // Allocate a file structure.
@@ -31,16 +32,11 @@ filealloc(void)
 {
   struct file *f;
 
-  acquire(&ftable.lock);
-  for(f = ftable.file; f < ftable.file + NFILE; f++){
-    if(f->ref == 0){
-      f->ref = 1;
-      release(&ftable.lock);
-      return f;
-    }
-  }
-  release(&ftable.lock);
-  return 0;
+  if((f = kmem_cache_alloc(ftable.cache)) == 0)
+    return 0;
+  memset(f, 0, sizeof(*f));
+  f->ref = 1;
+  return f;
 }
 
 // Increment ref count for file f.
@@ -72,6 +68,7 @@ fileclose(struct file *f)
   f->ref = 0;
   f->type = FD_NONE;
   release(&ftable.lock);
+  kmem_cache_free(ftable.cache, f);
 
   if(ff.type == FD_PIPE){
     pipeclose(ff.pipe, ff.writable);
@@ -101,6 +98,20 @@ filestat(struct file *f, uint64 addr)
   return -1;
 }
 
+// Force the data written to file f to disk.
+int
+filesync(struct file *f)
+{
+  int r;
+
+  if(f->type != FD_INODE)
+    return -1;
+  ilock(f->ip);
+  r = ifsync(f->ip);
+  iunlock(f->ip);
+  return r;
+}
+
 // Read from file f.
 // addr is a user virtual address.
 int
@@ -129,12 +140,51 @@ fileread(struct file *f, uint64 addr, int n)
   return r;
 }
 
+// Write n bytes to inode file f at its offset, from user
+// address addr if user_src, else kernel address addr.
+// Returns the number of bytes written.
+static int
+inodewrite(struct file *f, int user_src, uint64 addr, int n)
+{
+  // write as many blocks at a time as one FS op may,
+  // to avoid exceeding the maximum log transaction size,
+  // including i-node, indirect block, allocation blocks,
+  // and 2 blocks of slop for non-aligned writes.
+  // this really belongs lower down, since writei()
+  // might be writing a device like the console.
+  int nres = log_maxop();
+  int max = ((nres-1-1-2) / 2) * BSIZE;
+  int i = 0, r;
+
+  while(i < n){
+    int n1 = n - i;
+    if(n1 > max)
+      n1 = max;
+
+    begin_opn(nres);
+    ilock(f->ip);
+    if ((r = writei(f->ip, user_src, addr + i, f->off, n1)) > 0)
+      f->off += r;
+    iunlock(f->ip);
+    end_opn(nres);
+
+    if(r > 0)
+      i += r;
+    if(r != n1){
+      // error from writei
+      break;
+    }
+    bthrottle();
+  }
+  return i;
+}
+
 // Write to file f.
 // addr is a user virtual address.
 int
 filewrite(struct file *f, uint64 addr, int n)
 {
-  int r, ret = 0;
+  int ret = 0;
 
   if(f->writable == 0)
     return -1;
@@ -146,33 +196,7 @@ filewrite(struct file *f, uint64 addr, int n)
       return -1;
     ret = devsw[f->major].write(1, addr, n);
   } else if(f->type == FD_INODE){
-    // write a few blocks at a time to avoid exceeding
-    // the maximum log transaction size, including
-    // i-node, indirect block, allocation blocks,
-    // and 2 blocks of slop for non-aligned writes.
-    // this really belongs lower down, since writei()
-    // might be writing a device like the console.
-    int max = ((MAXOPBLOCKS-1-1-2) / 2) * BSIZE;
-    int i = 0;
-    while(i < n){
-      int n1 = n - i;
-      if(n1 > max)
-        n1 = max;
-
-      begin_op();
-      ilock(f->ip);
-      if ((r = writei(f->ip, 1, addr + i, f->off, n1)) > 0)
-        f->off += r;
-      iunlock(f->ip);
-      end_op();
-
-      if(r != n1){
-        // error from writei
-        break;
-      }
-      i += r;
-    }
-    ret = (i == n ? n : -1);
+    ret = (inodewrite(f, 1, addr, n) == n ? n : -1);
   } else {
     panic("filewrite");
   }
@@ -180,3 +204,84 @@ filewrite(struct file *f, uint64 addr, int n)
   return ret;
 }
 
+// Read up to n bytes from inode file f at its offset into
+// kernel address dst.
+static int
+inoderead(struct file *f, char *dst, int n)
+{
+  int r;
+
+  ilock(f->ip);
+  if((r = readi(f->ip, 0, (uint64)dst, f->off, n)) > 0)
+    f->off += r;
+  iunlock(f->ip);
+  return r;
+}
+
+// Move up to n bytes from file in to file out without passing
+// them through user space: from a file straight into a pipe's
+// buffer, from a pipe's buffer straight into a file, or from a
+// file to a file through a kernel page. Returns the number of
+// bytes moved, 0 at the end of in, or -1.
+int
+filesplice(struct file *in, struct file *out, int n)
+{
+  char *p;
+  int m, r, tot, err;
+
+  if(in->readable == 0 || out->writable == 0 || n < 0)
+    return -1;
+
+  tot = 0;
+  err = 0;
+  if(in->type == FD_INODE && out->type == FD_PIPE){
+    while(tot < n){
+      if((m = pipe_wbegin(out->pipe, &p, n - tot)) < 0){
+        err = 1;
+        break;
+      }
+      r = inoderead(in, p, m);
+      pipe_wend(out->pipe, r > 0 ? r : 0);
+      if(r <= 0){
+        err = (r < 0);
+        break;
+      }
+      tot += r;
+    }
+  } else if(in->type == FD_PIPE && out->type == FD_INODE){
+    // like read(), wait only for the first bytes.
+    while(tot < n){
+      if((m = pipe_rbegin(in->pipe, &p, n - tot, tot == 0)) <= 0){
+        err = (m < 0);
+        break;
+      }
+      r = inodewrite(out, 0, (uint64)p, m);
+      pipe_rend(in->pipe, r);
+      tot += r;
+      if(r != m){
+        err = 1;
+        break;
+      }
+    }
+  } else if(in->type == FD_INODE && out->type == FD_INODE){
+    if((p = kalloc()) == 0)
+      return -1;
+    while(tot < n){
+      m = n - tot < PGSIZE ? n - tot : PGSIZE;
+      if((r = inoderead(in, p, m)) <= 0){
+        err = (r < 0);
+        break;
+      }
+      m = inodewrite(out, 0, (uint64)p, r);
+      tot += m;
+      if(m != r){
+        err = 1;
+        break;
+      }
+    }
+    kfree(p);
+  } else {
+    return -1;
+  }
+  return tot > 0 || !err ? tot : -1;
+}
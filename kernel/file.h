@@ -18,15 +18,25 @@ struct inode {
   uint dev;           // Device number
   uint inum;          // Inode number
   int ref;            // Reference count
+  struct inode *next; // hash chain
+  struct inode *lnext, *lprev; // LRU list, if unreferenced
+  int inlru;          // on the LRU list?
   struct sleeplock lock; // protects everything below here
   int valid;          // inode has been read from disk?
+  uint ra_last;       // last block read, for read-ahead
+  uint ra_end;        // read-ahead started for blocks below this
+  uint ra_win;        // read-ahead window, in blocks
+  struct extent ext;  // last extent bmap() used, if extent-mapped
+  uint ind_first;     // first block mapped by ind_addr
+  uint ind_addr;      // last indirect block of data blocks bmap() used (its address only)
 
   short type;         // copy of disk inode
   short major;
   short minor;
   short nlink;
   uint size;
-  uint addrs[NDIRECT+1];
+  uint flags;
+  uint addrs[NADDR];
 };
 
 // map major device number to device functions.
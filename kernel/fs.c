@@ -22,18 +22,43 @@
 #include "file.h"
 
 #define min(a, b) ((a) < (b) ? (a) : (b))
+
+#define RA_MIN  2   // initial read-ahead window, in blocks
+#define RA_MAX  8   // largest read-ahead window
 // there should be one superblock per disk device, but we run with
 // only one device
 struct superblock sb; 
 
-// Read the super block.
+// Summary of the free block bitmap, counted at boot and kept
+// up to date by bgrab() and bfreecommit(), so that allocation
+// can skip full bitmap blocks without reading them.
+//
+// A block freed by a transaction is not free until that
+// transaction commits: were it reused before then, its new
+// data, written back ahead of the commit, would overwrite a
+// block that a crash would leave to its old file. bfree()
+// clears its bitmap bit but also sets it in pend, which
+// bgrab() treats as in use, until bfreecommit().
+struct {
+  struct spinlock lock;
+  uint *nfree;    // free blocks covered by each bitmap block
+  uint nbmap;     // number of bitmap blocks
+  uint cursor;    // next-fit: where bgrab() with no goal starts
+  uint64 *pend[2];  // freed by a transaction with seq of parity i
+  uint npend[2];    // number of bits set in pend[i]
+} fmap;
+
+static void fmapinit(int);
+
+// Read the super block, while the buffer cache still has
+// DEFBSIZE blocks.
 static void
 readsb(int dev, struct superblock *sb)
 {
   struct buf *bp;
 
-  bp = bread(dev, 1);
-  memmove(sb, bp->data, sizeof(*sb));
+  bp = bread(dev, SBOFF / DEFBSIZE);
+  memmove(sb, bp->data + SBOFF % DEFBSIZE, sizeof(*sb));
   brelse(bp);
 }
 
@@ -43,7 +68,15 @@ fsinit(int dev) {
   readsb(dev, &sb);
   if(sb.magic != FSMAGIC)
     panic("invalid file system");
+  if(sb.bsize == 0)
+    sb.bsize = DEFBSIZE;
+  if(sb.bsize < DEFBSIZE || sb.bsize > MAXBSIZE || (sb.bsize & (sb.bsize-1)))
+    panic("fsinit: bad block size");
+  if(sb.bsize != BSIZE)
+    bsetsize(sb.bsize);
   initlog(dev, &sb);
+  fmapinit(dev);
+  bflushinit();
 }
 
 // Zero a block.
@@ -60,39 +93,141 @@ bzero(int dev, int bno)
 
 // Blocks.
 
-// Allocate a zeroed disk block.
-// returns 0 if out of disk space.
+// Count the free blocks under each bitmap block.
+// Runs after log recovery, so the bitmap is up to date.
+static void
+fmapinit(int dev)
+{
+  struct buf *bp;
+  uint bn, bi;
+  int order, i;
+
+  initlock(&fmap.lock, "fmap");
+  fmap.nbmap = (sb.size + BPB - 1) / BPB;
+  for(order = 0; ((uint64)PGSIZE << order) < fmap.nbmap * sizeof(uint); order++)
+    ;
+  if((fmap.nfree = kalloc_pages(order)) == 0)
+    panic("fmapinit");
+  for(order = 0; ((uint64)PGSIZE << order) < fmap.nbmap * BSIZE; order++)
+    ;
+  for(i = 0; i < 2; i++){
+    if((fmap.pend[i] = kalloc_pages(order)) == 0)
+      panic("fmapinit");
+    memset(fmap.pend[i], 0, fmap.nbmap * BSIZE);
+    fmap.npend[i] = 0;
+  }
+  for(bn = 0; bn < fmap.nbmap; bn++){
+    fmap.nfree[bn] = 0;
+    bp = bread(dev, sb.bmapstart + bn);
+    for(bi = 0; bi < BPB && bn*BPB + bi < sb.size; bi++)
+      if((bp->data[bi/8] & (1 << (bi % 8))) == 0)
+        fmap.nfree[bn]++;
+    brelse(bp);
+  }
+  fmap.cursor = 0;
+}
+
+// Return the first clear bit at or after bit from in the
+// bitmap block bn, in bp, that is not pending free, or -1.
+// Skips a 64-bit word at a time while the words are full.
+// Caller holds fmap.lock.
+static int
+bfirst(struct buf *bp, uint bn, int from)
+{
+  uint64 *w = (uint64*)bp->data;
+  uint64 *p0 = fmap.pend[0] + bn * (BPB / 64);
+  uint64 *p1 = fmap.pend[1] + bn * (BPB / 64);
+  uint64 x;
+  int i, bi;
+
+  for(i = from / 64; i < BPB / 64; i++){
+    x = ~(w[i] | p0[i] | p1[i]);
+    if(i == from / 64)
+      x &= ~0ULL << (from % 64);
+    if(x == 0)
+      continue;
+    for(bi = 0; (x & 1) == 0; bi++)
+      x >>= 1;
+    return i*64 + bi;
+  }
+  return -1;
+}
+
+// Mark the first free block at or after bit from of bitmap
+// block bn in use. Returns 0 if there is none.
 static uint
-balloc(uint dev)
+bscan(uint dev, uint bn, int from)
 {
-  int b, bi, m;
   struct buf *bp;
+  int bi;
 
-  bp = 0;
-  for(b = 0; b < sb.size; b += BPB){
-    bp = bread(dev, BBLOCK(b, sb));
-    for(bi = 0; bi < BPB && b + bi < sb.size; bi++){
-      m = 1 << (bi % 8);
-      if((bp->data[bi/8] & m) == 0){  // Is block free?
-        bp->data[bi/8] |= m;  // Mark block in use.
-        log_write(bp);
-        brelse(bp);
-        bzero(dev, b + bi);
-        return b + bi;
-      }
-    }
+  bp = bread(dev, sb.bmapstart + bn);
+  acquire(&fmap.lock);
+  bi = bfirst(bp, bn, from);
+  release(&fmap.lock);
+  if(bi < 0 || bn*BPB + bi >= sb.size){
     brelse(bp);
+    return 0;
+  }
+  bp->data[bi/8] |= 1 << (bi % 8);  // Mark block in use.
+  log_write(bp);
+  brelse(bp);
+  return bn*BPB + bi;
+}
+
+// Allocate a disk block, preferably goal, or else the first
+// free one after it, so that callers asking for the block
+// after their previous one get contiguous runs.
+// goal 0 means no preference: carry on from the last block
+// allocated (next-fit).
+// returns 0 if out of disk space.
+static uint
+bgrab(uint dev, uint goal)
+{
+  uint b, bn, start, i;
+
+  acquire(&fmap.lock);
+  if(goal == 0 || goal >= sb.size)
+    goal = fmap.cursor;
+  release(&fmap.lock);
+
+  // the goal's bitmap block from goal on, the ones after it
+  // that have free blocks, then the goal's block from its start.
+  start = goal / BPB;
+  for(i = 0; i <= fmap.nbmap; i++){
+    bn = (start + i) % fmap.nbmap;
+    if(fmap.nfree[bn] == 0)
+      continue;
+    if((b = bscan(dev, bn, i == 0 ? goal % BPB : 0)) != 0){
+      acquire(&fmap.lock);
+      fmap.nfree[bn]--;
+      fmap.cursor = b + 1;
+      release(&fmap.lock);
+      return b;
+    }
   }
   printf("balloc: out of blocks\n");
   return 0;
 }
 
-// Free a disk block.
+// Allocate a zeroed disk block, as bgrab().
+static uint
+balloc(uint dev, uint goal)
+{
+  uint b;
+
+  if((b = bgrab(dev, goal)) != 0)
+    bzero(dev, b);
+  return b;
+}
+
+// Free a disk block, once the caller's transaction commits.
 static void
 bfree(int dev, uint b)
 {
   struct buf *bp;
   int bi, m;
+  uint k;
 
   bp = bread(dev, BBLOCK(b, sb));
   bi = b % BPB;
@@ -101,9 +236,43 @@ bfree(int dev, uint b)
     panic("freeing free block");
   bp->data[bi/8] &= ~m;
   log_write(bp);
+
+  k = log_opseq() & 1;
+  acquire(&fmap.lock);
+  fmap.pend[k][b / 64] |= 1ULL << (b % 64);
+  fmap.npend[k]++;
+  release(&fmap.lock);
   brelse(bp);
 }
 
+// Transaction seq has committed: the blocks it freed are free.
+// Called by the log after the commit, before the transaction
+// after next, which shares seq's pend map, can begin.
+void
+bfreecommit(uint seq)
+{
+  uint64 *p;
+  uint bn, i, k;
+  int n;
+
+  k = seq & 1;
+  acquire(&fmap.lock);
+  if(fmap.npend[k] == 0){
+    release(&fmap.lock);
+    return;
+  }
+  for(bn = 0; bn < fmap.nbmap; bn++){
+    p = fmap.pend[k] + bn * (BPB / 64);
+    for(i = 0; i < BPB / 64; i++){
+      for(n = 0; p[i]; n++)
+        p[i] &= p[i] - 1;
+      fmap.nfree[bn] += n;
+    }
+  }
+  fmap.npend[k] = 0;
+  release(&fmap.lock);
+}
+
 // Inodes.
 //
 // An inode describes a single unnamed file.
@@ -129,18 +298,19 @@ bfree(int dev, uint b)
 //   is non-zero. ialloc() allocates, and iput() frees if
 //   the reference and link counts have fallen to zero.
 //
-// * Referencing in table: an entry in the inode table
-//   is free if ip->ref is zero. Otherwise ip->ref tracks
-//   the number of in-memory pointers to the entry (open
+// * Referencing in table: ip->ref tracks the number of
+//   in-memory pointers to an entry of the inode table (open
 //   files and current directories). iget() finds or
 //   creates a table entry and increments its ref; iput()
-//   decrements ref.
+//   decrements ref. An entry whose ref is zero stays in the
+//   table, on a least-recently-used list, until it is
+//   recycled.
 //
 // * Valid: the information (type, size, &c) in an inode
 //   table entry is only correct when ip->valid is 1.
 //   ilock() reads the inode from
 //   the disk and sets ip->valid, while iput() clears
-//   ip->valid if ip->ref has fallen to zero.
+//   ip->valid when it frees the inode.
 //
 // * Locked: file system code may only examine and modify
 //   the information in an inode and its content if it
@@ -164,32 +334,130 @@ bfree(int dev, uint b)
 // have locked the inodes involved; this lets callers create
 // multi-step atomic operations.
 //
-// The itable.lock spin-lock protects the allocation of itable
-// entries. Since ip->ref indicates whether an entry is free,
-// and ip->dev and ip->inum indicate which i-node an entry
-// holds, one must hold itable.lock while using any of those fields.
+// The inode table is a hash table keyed on (dev, inum), with
+// entries allocated from a slab cache as needed. A bucket's
+// spin-lock protects the list of entries in it, and their ref;
+// ip->dev and ip->inum do not change while an entry is in the
+// table.
+//
+// Unreferenced entries are kept, still valid, on the LRU list
+// (protected by itable.lock, which is taken after bucket locks)
+// so that reopening a file does not read its inode again.
+// Beyond NINODE of them the least recently used are freed, as
+// are all of them when kalloc() runs out of memory.
 //
 // An ip->lock sleep-lock protects all ip-> fields other than ref,
-// dev, and inum.  One must hold ip->lock in order to
+// dev, inum and the list links.  One must hold ip->lock in order to
 // read or write that inode's ip->valid, ip->size, ip->type, &c.
 
-struct {
+#define NIHASH 127
+#define IHASH(dev, inum) (((dev) * 31 + (inum)) % NIHASH)
+
+struct ibucket {
   struct spinlock lock;
-  struct inode inode[NINODE];
+  struct inode *head;       // chain through ip->next
+};
+
+struct {
+  struct spinlock lock;     // protects the LRU list
+  struct inode lru;         // unreferenced entries, most recent first
+  int nlru;
+  struct ibucket bucket[NIHASH];
+  struct kmem_cache *cache;
 } itable;
 
+// runs once per inode object, when its slab is created.
+static void
+inodector(void *p)
+{
+  initsleeplock(&((struct inode*)p)->lock, "inode");
+}
+
 void
 iinit()
 {
   int i = 0;
   
   initlock(&itable.lock, "itable");
-  for(i = 0; i < NINODE; i++) {
-    initsleeplock(&itable.inode[i].lock, "inode");
+  itable.lru.lnext = itable.lru.lprev = &itable.lru;
+  for(i = 0; i < NIHASH; i++)
+    initlock(&itable.bucket[i].lock, "itable.bucket");
+  itable.cache = kmem_cache_create("inode", sizeof(struct inode), inodector);
+}
+
+// Caller holds itable.lock.
+static void
+lru_remove(struct inode *ip)
+{
+  ip->lnext->lprev = ip->lprev;
+  ip->lprev->lnext = ip->lnext;
+  ip->inlru = 0;
+  itable.nlru--;
+}
+
+static struct inode*
+ifind(struct ibucket *bk, uint dev, uint inum)
+{
+  struct inode *ip;
+
+  for(ip = bk->head; ip; ip = ip->next)
+    if(ip->dev == dev && ip->inum == inum)
+      return ip;
+  return 0;
+}
+
+// Free least recently used unreferenced inode table entries
+// until only keep are left. Returns the number freed.
+static int
+ievict(int keep)
+{
+  struct ibucket *bk;
+  struct inode *ip, **pp;
+  uint dev, inum;
+  int n;
+
+  for(n = 0; ; ){
+    acquire(&itable.lock);
+    if(itable.nlru <= keep){
+      release(&itable.lock);
+      return n;
+    }
+    // only note which inode is the oldest: its bucket lock comes
+    // before itable.lock, and once that is released the entry
+    // may be taken, put back or freed by someone else.
+    ip = itable.lru.lprev;
+    dev = ip->dev;
+    inum = ip->inum;
+    release(&itable.lock);
+
+    bk = &itable.bucket[IHASH(dev, inum)];
+    acquire(&bk->lock);
+    ip = ifind(bk, dev, inum);
+    acquire(&itable.lock);
+    if(ip == 0 || ip->ref > 0 || !ip->inlru){
+      // iget() or another ievict() got to it first.
+      release(&itable.lock);
+      release(&bk->lock);
+      continue;
+    }
+    lru_remove(ip);
+    release(&itable.lock);
+    for(pp = &bk->head; *pp != ip; pp = &(*pp)->next)
+      ;
+    *pp = ip->next;
+    release(&bk->lock);
+    kmem_cache_free(itable.cache, ip);
+    n++;
   }
 }
 
-static struct inode* iget(uint dev, uint inum);
+// Free every unreferenced inode table entry, to give memory
+// back when kalloc() runs out.
+int
+ishrink(void)
+{
+  return ievict(0);
+}
 
 // Allocate an inode on device dev.
 // Mark it as allocated by  giving it type type.
@@ -208,6 +476,13 @@ ialloc(uint dev, short type)
     if(dip->type == 0){  // a free inode
       memset(dip, 0, sizeof(*dip));
       dip->type = type;
+      if(sb.features & FS_EXTENTS)
+        dip->flags = DI_EXTENTS;  // and an empty root
+      if(type == T_FILE && (sb.features & FS_INLINE))
+        dip->flags = DI_INLINE;   // and no data
+      if(type == T_DIR && (sb.features & FS_HASHDIR))
+        dip->flags |= DI_HASHDIR;
+
       log_write(bp);   // mark it allocated on the disk
       brelse(bp);
       return iget(dev, inum);
@@ -235,6 +510,7 @@ iupdate(struct inode *ip)
   dip->minor = ip->minor;
   dip->nlink = ip->nlink;
   dip->size = ip->size;
+  dip->flags = ip->flags;
   memmove(dip->addrs, ip->addrs, sizeof(ip->addrs));
   log_write(bp);
   brelse(bp);
@@ -243,35 +519,56 @@ iupdate(struct inode *ip)
 // Find the inode with number inum on device dev
 // and return the in-memory copy. Does not lock
 // the inode and does not read it from disk.
-static struct inode*
+struct inode*
 iget(uint dev, uint inum)
 {
-  struct inode *ip, *empty;
-
-  acquire(&itable.lock);
+  struct ibucket *bk = &itable.bucket[IHASH(dev, inum)];
+  struct inode *ip, *nip;
 
   // Is the inode already in the table?
-  empty = 0;
-  for(ip = &itable.inode[0]; ip < &itable.inode[NINODE]; ip++){
-    if(ip->ref > 0 && ip->dev == dev && ip->inum == inum){
-      ip->ref++;
+  acquire(&bk->lock);
+  if((ip = ifind(bk, dev, inum)) != 0){
+    if(ip->ref++ == 0){
+      acquire(&itable.lock);
+      if(ip->inlru)
+        lru_remove(ip);
       release(&itable.lock);
-      return ip;
     }
-    if(empty == 0 && ip->ref == 0)    // Remember empty slot.
-      empty = ip;
+    release(&bk->lock);
+    return ip;
+  }
+  release(&bk->lock);
+
+  // Allocate an entry with no locks held, since ishrink()
+  // takes the bucket locks.
+  if((nip = kmem_cache_alloc(itable.cache)) == 0){
+    ishrink();
+    if((nip = kmem_cache_alloc(itable.cache)) == 0)
+      panic("iget: no inodes");
   }
 
-  // Recycle an inode entry.
-  if(empty == 0)
-    panic("iget: no inodes");
-
-  ip = empty;
+  acquire(&bk->lock);
+  if((ip = ifind(bk, dev, inum)) != 0){
+    // someone else added it meanwhile.
+    if(ip->ref++ == 0){
+      acquire(&itable.lock);
+      if(ip->inlru)
+        lru_remove(ip);
+      release(&itable.lock);
+    }
+    release(&bk->lock);
+    kmem_cache_free(itable.cache, nip);
+    return ip;
+  }
+  ip = nip;
   ip->dev = dev;
   ip->inum = inum;
   ip->ref = 1;
   ip->valid = 0;
-  release(&itable.lock);
+  ip->inlru = 0;
+  ip->next = bk->head;
+  bk->head = ip;
+  release(&bk->lock);
 
   return ip;
 }
@@ -281,9 +578,11 @@ iget(uint dev, uint inum)
 struct inode*
 idup(struct inode *ip)
 {
-  acquire(&itable.lock);
+  struct ibucket *bk = &itable.bucket[IHASH(ip->dev, ip->inum)];
+
+  acquire(&bk->lock);
   ip->ref++;
-  release(&itable.lock);
+  release(&bk->lock);
   return ip;
 }
 
@@ -308,8 +607,12 @@ ilock(struct inode *ip)
     ip->minor = dip->minor;
     ip->nlink = dip->nlink;
     ip->size = dip->size;
+    ip->flags = dip->flags;
     memmove(ip->addrs, dip->addrs, sizeof(ip->addrs));
     brelse(bp);
+    ip->ra_last = ip->ra_end = ip->ra_win = 0;
+    ip->ext.len = 0;
+    ip->ind_addr = 0;
     ip->valid = 1;
     if(ip->type == 0)
       panic("ilock: no type");
@@ -336,7 +639,10 @@ iunlock(struct inode *ip)
 void
 iput(struct inode *ip)
 {
-  acquire(&itable.lock);
+  struct ibucket *bk = &itable.bucket[IHASH(ip->dev, ip->inum)];
+  int evict;
+
+  acquire(&bk->lock);
 
   if(ip->ref == 1 && ip->valid && ip->nlink == 0){
     // inode has no links and no other references: truncate and free.
@@ -345,20 +651,37 @@ iput(struct inode *ip)
     // so this acquiresleep() won't block (or deadlock).
     acquiresleep(&ip->lock);
 
-    release(&itable.lock);
+    release(&bk->lock);
 
     itrunc(ip);
     ip->type = 0;
     iupdate(ip);
     ip->valid = 0;
+    dcache_purge(ip->dev, ip->inum);  // the inum may be reused
 
     releasesleep(&ip->lock);
 
+    acquire(&bk->lock);
+  }
+
+  evict = 0;
+  if(--ip->ref == 0){
     acquire(&itable.lock);
+    if(!ip->inlru){
+      ip->lnext = itable.lru.lnext;
+      ip->lprev = &itable.lru;
+      itable.lru.lnext->lprev = ip;
+      itable.lru.lnext = ip;
+      ip->inlru = 1;
+      itable.nlru++;
+    }
+    evict = itable.nlru > NINODE;
+    release(&itable.lock);
   }
+  release(&bk->lock);
 
-  ip->ref--;
-  release(&itable.lock);
+  if(evict)
+    ievict(NINODE);
 }
 
 // Common idiom: unlock, then put.
@@ -372,9 +695,299 @@ iunlockput(struct inode *ip)
 // Inode content
 //
 // The content (data) associated with each inode is stored
-// in blocks on the disk. The first NDIRECT block numbers
-// are listed in ip->addrs[].  The next NINDIRECT blocks are
-// listed in block ip->addrs[NDIRECT].
+// in blocks on the disk. In a block-mapped inode, the first
+// NDIRECT block numbers are listed in ip->addrs[].  The next
+// NINDIRECT blocks are listed in block ip->addrs[NDIRECT],
+// the NDINDIRECT after those in the indirect blocks listed in
+// block ip->addrs[NDIRECT+1], and the NTINDIRECT after those
+// one level further down from ip->addrs[NDIRECT+2].
+// In an extent-mapped inode (DI_EXTENTS), ip->addrs[] holds
+// the root of an extent tree; see fs.h.
+//
+// The content of directories is logged like the rest of the
+// metadata, but that of regular files is written back from the
+// buffer cache later (ordered mode; see log.c).
+
+// Caller has modified bp, a block of ip's content; grow says
+// whether the block was just added to the file or holds data
+// past its old end. File data is left dirty in the cache, and
+// if grow, written back before the next commit; it is logged
+// only if the log has a copy of the block yet to install.
+static void
+dwrite(struct inode *ip, struct buf *bp, int grow)
+{
+  if(ip->type != T_FILE || bpinned(bp)){
+    log_write(bp);
+    return;
+  }
+  bdirty(bp);
+  if(grow)
+    bordered(bp);
+}
+
+// Allocate a zeroed block for ip's content, as bgrab(). A file
+// data block is zeroed in the cache only, not read or logged.
+static uint
+dalloc(struct inode *ip, uint goal)
+{
+  struct buf *bp;
+  uint b;
+
+  if(ip->type != T_FILE)
+    return balloc(ip->dev, goal);
+  if((b = bgrab(ip->dev, goal)) != 0){
+    bp = bnew(ip->dev, b);
+    dwrite(ip, bp, 1);
+    brelse(bp);
+  }
+  return b;
+}
+
+// Extent trees.
+
+#define EXT(h) ((struct extent*)((struct exthdr*)(h) + 1))
+
+static struct exthdr*
+ext_root(struct inode *ip)
+{
+  return (struct exthdr*)ip->addrs;
+}
+
+// Index of the last entry of node h with lblk <= bn, or 0.
+static int
+ext_find(struct exthdr *h, uint bn)
+{
+  struct extent *e = EXT(h);
+  int lo = 0, hi = h->n, mid;
+
+  while(hi - lo > 1){
+    mid = (lo + hi) / 2;
+    if(e[mid].lblk <= bn)
+      lo = mid;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+// Allocate n blocks for new tree nodes, from goal on.
+// Returns 0, with none allocated, if out of disk space.
+static int
+ext_newnodes(uint dev, uint *nb, int n, uint goal)
+{
+  int i;
+
+  for(i = 0; i < n; i++){
+    if((nb[i] = balloc(dev, goal)) == 0){
+      while(--i >= 0)
+        bfree(dev, nb[i]);
+      return 0;
+    }
+    goal = nb[i] + 1;
+  }
+  return 1;
+}
+
+// Add extent x, which lies past every block mapped so far, to
+// the right edge of ip's tree. Returns 0 if out of disk space.
+// Caller must hold ip->lock and calls iupdate() later.
+static int
+ext_append(struct inode *ip, struct extent *x)
+{
+  struct buf *path[EXTDEPTH+1], *bp;
+  struct exthdr *h[EXTDEPTH+1], *nh;
+  struct extent *e;
+  uint nb[EXTDEPTH];
+  int d, k, level, ok, grow;
+
+  for(;;){
+    // walk down the right edge of the tree.
+    h[0] = ext_root(ip);
+    path[0] = 0;
+    for(level = 0; h[level]->depth > 0; level++){
+      path[level+1] = bread(ip->dev, EXT(h[level])[h[level]->n - 1].pblk);
+      h[level+1] = (struct exthdr*)path[level+1]->data;
+    }
+
+    // find the lowest node on it with room.
+    for(d = level; d >= 0; d--)
+      if(h[d]->n < (d == 0 ? NEXTROOT : NEXTNODE))
+        break;
+
+    ok = 1;
+    grow = 0;
+    if(d < 0){
+      // the tree is full: move the root's entries into a new
+      // node below it, and start over.
+      if(h[0]->depth == EXTDEPTH || !ext_newnodes(ip->dev, nb, 1, 0)){
+        ok = 0;
+      } else {
+        bp = bread(ip->dev, nb[0]);
+        memmove(bp->data, h[0], sizeof(struct exthdr) + h[0]->n * sizeof(struct extent));
+        log_write(bp);
+        brelse(bp);
+        h[0]->depth++;
+        h[0]->n = 1;
+        EXT(h[0])[0].pblk = nb[0];
+        EXT(h[0])[0].len = 0;
+        grow = 1;
+      }
+    } else if(!ext_newnodes(ip->dev, nb, h[d]->depth, 0)){
+      ok = 0;
+    } else {
+      // below node d, build a chain of new nodes down to a leaf
+      // holding x, and add the top of it (or x itself, if d is
+      // the leaf) to node d.
+      for(k = 0; k < h[d]->depth; k++){
+        bp = bread(ip->dev, nb[k]);
+        nh = (struct exthdr*)bp->data;
+        nh->n = 1;
+        nh->depth = k;
+        e = EXT(nh);
+        if(k == 0){
+          *e = *x;
+        } else {
+          e->lblk = x->lblk;
+          e->pblk = nb[k-1];
+          e->len = 0;
+        }
+        log_write(bp);
+        brelse(bp);
+      }
+      e = &EXT(h[d])[h[d]->n++];
+      if(h[d]->depth == 0){
+        *e = *x;
+      } else {
+        e->lblk = x->lblk;
+        e->pblk = nb[h[d]->depth - 1];
+        e->len = 0;
+      }
+      if(path[d])
+        log_write(path[d]);
+    }
+
+    for(k = 1; k <= level; k++)
+      brelse(path[k]);
+    if(!grow)
+      return ok;
+  }
+}
+
+// bmap() for extent-mapped inodes.
+static uint
+ext_bmap(struct inode *ip, uint bn)
+{
+  struct buf *bp, *next;
+  struct exthdr *h;
+  struct extent *e, x;
+  uint addr, goal;
+
+  // the last extent used covers most sequential accesses.
+  if(bn - ip->ext.lblk < ip->ext.len)
+    return ip->ext.pblk + (bn - ip->ext.lblk);
+
+  // look it up.
+  h = ext_root(ip);
+  bp = 0;
+  while(h->depth > 0){
+    next = bread(ip->dev, EXT(h)[ext_find(h, bn)].pblk);
+    if(bp)
+      brelse(bp);
+    bp = next;
+    h = (struct exthdr*)bp->data;
+  }
+  e = h->n > 0 ? &EXT(h)[ext_find(h, bn)] : 0;
+  if(e && bn - e->lblk < e->len){
+    ip->ext = *e;
+    if(bp)
+      brelse(bp);
+    return ip->ext.pblk + (bn - ip->ext.lblk);
+  }
+
+  // not mapped, so past the end of the file (writei() never
+  // leaves holes): e is the last extent. Extend it if the next
+  // disk block is free, else start a new extent.
+  if(e && bn < e->lblk + e->len)
+    panic("ext_bmap: hole");
+  goal = e ? e->pblk + e->len : 0;
+  if((addr = dalloc(ip, goal)) == 0){
+    if(bp)
+      brelse(bp);
+    return 0;
+  }
+  if(e && bn == e->lblk + e->len && addr == goal){
+    e->len++;
+    if(bp)
+      log_write(bp);
+    ip->ext = *e;
+    if(bp)
+      brelse(bp);
+    return addr;
+  }
+  if(bp)
+    brelse(bp);
+
+  x.lblk = bn;
+  x.pblk = addr;
+  x.len = 1;
+  if(!ext_append(ip, &x)){
+    bfree(ip->dev, addr);
+    return 0;
+  }
+  ip->ext = x;
+  return addr;
+}
+
+// Free the blocks of ip's tree below node h, and the nodes.
+static void
+ext_free(struct inode *ip, struct exthdr *h)
+{
+  struct extent *e;
+  struct buf *bp;
+  uint b;
+
+  for(e = EXT(h); e < EXT(h) + h->n; e++){
+    if(h->depth > 0){
+      bp = bread(ip->dev, e->pblk);
+      ext_free(ip, (struct exthdr*)bp->data);
+      brelse(bp);
+      bfree(ip->dev, e->pblk);
+    } else {
+      for(b = e->pblk; b < e->pblk + e->len; b++)
+        bfree(ip->dev, b);
+    }
+  }
+}
+
+// Block after b, as an allocation goal; 0 (none) if b is 0.
+#define NEXT(b) ((b) ? (b) + 1 : 0)
+
+// Return entry i of indirect block addr, allocating a block for
+// it if there is none, next to the previous entry's block (or
+// to the indirect block itself); a data block if leaf, else an
+// indirect block. Returns 0 if out of disk space.
+static uint
+ind_entry(struct inode *ip, uint addr, uint i, int leaf)
+{
+  uint goal;
+  struct buf *bp;
+  uint *a;
+
+  bp = bread(ip->dev, addr);
+  a = (uint*)bp->data;
+  if(a[i] == 0){
+    goal = i > 0 && a[i-1] ? a[i-1] + 1 : addr + 1;
+    addr = leaf ? dalloc(ip, goal) : balloc(ip->dev, goal);
+    if(addr){
+      a[i] = addr;
+      log_write(bp);
+    }
+  } else {
+    addr = a[i];
+  }
+  brelse(bp);
+  return addr;
+}
 
 // Return the disk block address of the nth block in inode ip.
 // If there is no such block, bmap allocates one.
@@ -382,76 +995,148 @@ iunlockput(struct inode *ip)
 static uint
 bmap(struct inode *ip, uint bn)
 {
-  uint addr, *a;
-  struct buf *bp;
+  uint addr, *slot, fbn;
+  uint64 span;
+  int level;
+
+  if(ip->flags & DI_INLINE)
+    panic("bmap: inline");
+  if(ip->flags & DI_EXTENTS)
+    return ext_bmap(ip, bn);
 
   if(bn < NDIRECT){
     if((addr = ip->addrs[bn]) == 0){
-      addr = balloc(ip->dev);
+      addr = dalloc(ip, bn > 0 ? NEXT(ip->addrs[bn-1]) : 0);
       if(addr == 0)
         return 0;
       ip->addrs[bn] = addr;
     }
     return addr;
   }
+
+  // the indirect block of data blocks used last covers most
+  // sequential accesses without walking down from the inode.
+  // Only its address is kept: each lookup still bread()s it,
+  // usually from the cache, but skips the blocks above it.
+  if(ip->ind_addr && bn - ip->ind_first < NINDIRECT)
+    return ind_entry(ip, ip->ind_addr, bn - ip->ind_first, 1);
+
+  // which tree: singly, doubly or triply indirect?
+  fbn = bn;
   bn -= NDIRECT;
+  span = NINDIRECT;
+  for(level = 1; bn >= span; level++){
+    if(level == 3)
+      panic("bmap: out of range");
+    bn -= span;
+    span *= NINDIRECT;
+  }
 
-  if(bn < NINDIRECT){
-    // Load indirect block, allocating if necessary.
-    if((addr = ip->addrs[NDIRECT]) == 0){
-      addr = balloc(ip->dev);
-      if(addr == 0)
-        return 0;
-      ip->addrs[NDIRECT] = addr;
-    }
-    bp = bread(ip->dev, addr);
-    a = (uint*)bp->data;
-    if((addr = a[bn]) == 0){
-      addr = balloc(ip->dev);
-      if(addr){
-        a[bn] = addr;
-        log_write(bp);
-      }
-    }
-    brelse(bp);
-    return addr;
+  // Load the top indirect block, allocating if necessary.
+  slot = &ip->addrs[NDIRECT + level - 1];
+  if((addr = *slot) == 0){
+    addr = balloc(ip->dev, NEXT(ip->addrs[NDIRECT-1]));
+    if(addr == 0)
+      return 0;
+    *slot = addr;
   }
 
-  panic("bmap: out of range");
+  // walk down to the indirect block of data blocks.
+  for(span /= NINDIRECT; span > 1; span /= NINDIRECT){
+    if((addr = ind_entry(ip, addr, bn / span % NINDIRECT, 0)) == 0)
+      return 0;
+  }
+  ip->ind_addr = addr;
+  ip->ind_first = fbn - bn % NINDIRECT;
+  return ind_entry(ip, addr, bn % NINDIRECT, 1);
 }
 
-// Truncate inode (discard contents).
-// Caller must hold ip->lock.
-void
-itrunc(struct inode *ip)
+// Free indirect block addr, which is level levels above the
+// data blocks, and all the blocks below it.
+static void
+ind_free(struct inode *ip, uint addr, int level)
 {
-  int i, j;
   struct buf *bp;
   uint *a;
+  int j;
 
-  for(i = 0; i < NDIRECT; i++){
-    if(ip->addrs[i]){
-      bfree(ip->dev, ip->addrs[i]);
-      ip->addrs[i] = 0;
-    }
+  bp = bread(ip->dev, addr);
+  a = (uint*)bp->data;
+  for(j = 0; j < NINDIRECT; j++){
+    if(a[j] == 0)
+      continue;
+    if(level > 1)
+      ind_free(ip, a[j], level - 1);
+    else
+      bfree(ip->dev, a[j]);
   }
+  brelse(bp);
+  bfree(ip->dev, addr);
+}
 
-  if(ip->addrs[NDIRECT]){
-    bp = bread(ip->dev, ip->addrs[NDIRECT]);
-    a = (uint*)bp->data;
-    for(j = 0; j < NINDIRECT; j++){
-      if(a[j])
-        bfree(ip->dev, a[j]);
+// Truncate inode (discard contents).
+// Caller must hold ip->lock.
+void
+itrunc(struct inode *ip)
+{
+  int i;
+
+  if(ip->flags & DI_INLINE){
+    // nothing to free.
+  } else if(ip->flags & DI_EXTENTS){
+    ext_free(ip, ext_root(ip));
+    ip->ext.len = 0;
+  } else {
+    for(i = 0; i < NDIRECT; i++){
+      if(ip->addrs[i])
+        bfree(ip->dev, ip->addrs[i]);
     }
-    brelse(bp);
-    bfree(ip->dev, ip->addrs[NDIRECT]);
-    ip->addrs[NDIRECT] = 0;
+    for(i = 0; i < 3; i++){
+      if(ip->addrs[NDIRECT+i])
+        ind_free(ip, ip->addrs[NDIRECT+i], i + 1);
+    }
+    ip->ind_addr = 0;
   }
+  memset(ip->addrs, 0, sizeof(ip->addrs));  // an empty root, if extents
+
+  // an emptied file can keep its data inline again.
+  if(ip->type == T_FILE && (sb.features & FS_INLINE))
+    ip->flags = DI_INLINE;
 
   ip->size = 0;
   iupdate(ip);
 }
 
+// Move the inline data of ip to a block, so that the file can
+// grow past NINLINE bytes. Returns -1 if out of disk space.
+// Caller must hold ip->lock.
+static int
+inline_promote(struct inode *ip)
+{
+  char data[NINLINE];
+  uint flags, addr;
+  struct buf *bp;
+
+  flags = ip->flags;
+  memmove(data, ip->addrs, NINLINE);
+  memset(ip->addrs, 0, sizeof(ip->addrs));
+  ip->flags = (sb.features & FS_EXTENTS) ? DI_EXTENTS : 0;
+  ip->ext.len = 0;
+  ip->ind_addr = 0;
+  if(ip->size > 0){
+    if((addr = bmap(ip, 0)) == 0){
+      memmove(ip->addrs, data, NINLINE);
+      ip->flags = flags;
+      return -1;
+    }
+    bp = bread(ip->dev, addr);
+    memmove(bp->data, data, ip->size);
+    dwrite(ip, bp, 1);
+    brelse(bp);
+  }
+  return 0;
+}
+
 // Copy stat information from inode.
 // Caller must hold ip->lock.
 void
@@ -464,6 +1149,50 @@ stati(struct inode *ip, struct stat *st)
   st->size = ip->size;
 }
 
+// Sequential read-ahead.
+// A read that starts in the block where the previous one ended,
+// or in the next one, is sequential; each sequential read doubles
+// the inode's read-ahead window (up to RA_MAX) and starts
+// asynchronous reads of the blocks up to that many past the end
+// of the read, so the disk works while readi() copies.
+// Any other read collapses the window.
+// Caller must hold ip->lock; n > 0 and off+n <= ip->size.
+static void
+readahead(struct inode *ip, uint off, uint n)
+{
+  uint bn, first, last, end, addr;
+  uint addrs[RA_MAX + 1];
+  int n1;
+
+  first = off / BSIZE;
+  last = (off + n - 1) / BSIZE;
+  if(first == ip->ra_last || first == ip->ra_last + 1){
+    ip->ra_win = ip->ra_win ? min(2 * ip->ra_win, RA_MAX) : RA_MIN;
+  } else {
+    ip->ra_win = 0;
+    ip->ra_end = 0;
+  }
+  ip->ra_last = last;
+  if(ip->ra_win == 0)
+    return;
+
+  end = min(last + 1 + ip->ra_win, (ip->size + BSIZE - 1) / BSIZE);
+  bn = ip->ra_end > first ? ip->ra_end : first;
+  while(bn < end){
+    // the blocks of this read count too, so that a read of
+    // many blocks has them all in flight at once.
+    for(n1 = 0; bn < end && n1 < NELEM(addrs); bn++){
+      if((addr = bmap(ip, bn)) == 0)
+        break;
+      addrs[n1++] = addr;
+    }
+    breadahead(ip->dev, addrs, n1);
+    if(addr == 0)
+      break;
+  }
+  ip->ra_end = bn;
+}
+
 // Read data from inode.
 // Caller must hold ip->lock.
 // If user_dst==1, then dst is a user virtual address;
@@ -478,6 +1207,13 @@ readi(struct inode *ip, int user_dst, uint64 dst, uint off, uint n)
     return 0;
   if(off + n > ip->size)
     n = ip->size - off;
+  if(ip->flags & DI_INLINE){
+    if(either_copyout(user_dst, dst, (char*)ip->addrs + off, n) == -1)
+      return -1;
+    return n;
+  }
+  if(n > 0 && ip->type == T_FILE)
+    readahead(ip, off, n);
 
   for(tot=0; tot<n; tot+=m, off+=m, dst+=m){
     uint addr = bmap(ip, off/BSIZE);
@@ -510,7 +1246,22 @@ writei(struct inode *ip, int user_src, uint64 src, uint off, uint n)
 
   if(off > ip->size || off + n < off)
     return -1;
-  if(off + n > MAXFILE*BSIZE)
+  if(ip->flags & DI_INLINE){
+    if(off + n <= NINLINE){
+      if(either_copyin((char*)ip->addrs + off, user_src, src, n) == -1)
+        return -1;
+      if(off + n > ip->size)
+        ip->size = off + n;
+      iupdate(ip);
+      return n;
+    }
+    if(inline_promote(ip) < 0)
+      return -1;
+  }
+  // a size must fit ip->size, which is 32 bits (off + n < off
+  // above), and a block-mapped file must fit its trees, which
+  // with big blocks map more than 32 bits can count.
+  if(!(ip->flags & DI_EXTENTS) && (uint64)off + n > (uint64)MAXFILE*BSIZE)
     return -1;
 
   for(tot=0; tot<n; tot+=m, off+=m, src+=m){
@@ -523,7 +1274,7 @@ writei(struct inode *ip, int user_src, uint64 src, uint off, uint n)
       brelse(bp);
       break;
     }
-    log_write(bp);
+    dwrite(ip, bp, off + m > ip->size);
     brelse(bp);
   }
 
@@ -538,6 +1289,32 @@ writei(struct inode *ip, int user_src, uint64 src, uint off, uint n)
   return tot;
 }
 
+// Write ip's dirty data back to disk. Its metadata needs no
+// forcing: every FS system call returns only once its
+// transaction has committed.
+// Caller must hold ip->lock.
+int
+ifsync(struct inode *ip)
+{
+  uint blocks[16], bn, nb;
+  int n;
+
+  if(ip->type != T_FILE || (ip->flags & DI_INLINE))
+    return 0;
+  nb = (ip->size + BSIZE - 1) / BSIZE;
+  n = 0;
+  for(bn = 0; bn < nb; bn++){
+    // all mapped, since writei() never leaves holes.
+    if((blocks[n++] = bmap(ip, bn)) == 0)
+      panic("ifsync");
+    if(n == NELEM(blocks) || bn == nb - 1){
+      bsync(ip->dev, blocks, n);
+      n = 0;
+    }
+  }
+  return 0;
+}
+
 // Directories
 
 int
@@ -546,6 +1323,300 @@ namecmp(const char *s, const char *t)
   return strncmp(s, t, DIRSIZ);
 }
 
+// Hashed directories.
+
+#define DPB (BSIZE / sizeof(struct dirent))
+
+static uint
+dirhash(char *name)
+{
+  uint h = 2166136261;  // FNV-1a
+  int i;
+
+  for(i = 0; i < DIRSIZ && name[i]; i++)
+    h = (h ^ (uchar)name[i]) * 16777619;
+  return h;
+}
+
+// Slot i of the bucket table in block 0.
+static ushort*
+dirtab(struct buf *bp, uint i)
+{
+  struct dirent *de = (struct dirent*)bp->data + DIRTAB + i / DIRTABPER;
+
+  return (ushort*)de->name + i % DIRTABPER;
+}
+
+#define DIRHDRP(bp, e) ((struct dirhdr*)((struct dirent*)(bp)->data + (e)))
+
+// Block fb of directory dp, allocated if past its end;
+// 0 if out of disk space.
+static struct buf*
+dirblock(struct inode *dp, uint fb)
+{
+  uint addr;
+
+  if((addr = bmap(dp, fb)) == 0)
+    return 0;
+  return bread(dp->dev, addr);
+}
+
+// Block number of the first block of name's bucket.
+static uint
+hdirbucket(struct inode *dp, uint h)
+{
+  struct buf *bp;
+  uint fb;
+
+  bp = dirblock(dp, 0);
+  if(DIRHDRP(bp, DIRHDR)->magic != DIRMAGIC)
+    panic("hashed directory");
+  fb = *dirtab(bp, h & ((1 << DIRHDRP(bp, DIRHDR)->depth) - 1));
+  brelse(bp);
+  return fb;
+}
+
+// Search a hashed directory: "." and ".." are the first two
+// entries of block 0, other names are in their bucket's chain.
+static int
+hdirlookup(struct inode *dp, char *name, uint *poff)
+{
+  struct buf *bp;
+  struct dirent *de;
+  uint fb, i, lo, hi, inum;
+
+  if(dp->size == 0)
+    return 0;
+  if(namecmp(name, ".") == 0 || namecmp(name, "..") == 0){
+    fb = 0;
+    lo = 0;
+    hi = 2;
+  } else {
+    fb = hdirbucket(dp, dirhash(name));
+    lo = 1;
+    hi = DPB;
+  }
+  for(;;){
+    bp = dirblock(dp, fb);
+    de = (struct dirent*)bp->data;
+    for(i = lo; i < hi; i++){
+      if(de[i].inum && namecmp(name, de[i].name) == 0){
+        inum = de[i].inum;
+        if(poff)
+          *poff = fb*BSIZE + i*sizeof(*de);
+        brelse(bp);
+        return inum;
+      }
+    }
+    fb = fb ? DIRHDRP(bp, 0)->next : 0;
+    brelse(bp);
+    if(fb == 0)
+      return 0;
+  }
+}
+
+// Append a block to directory dp and start a bucket in it.
+// Returns it locked, or 0 if out of disk space.
+static struct buf*
+hdirgrow(struct inode *dp, int depth)
+{
+  struct buf *bp;
+  struct dirhdr *h;
+
+  if((bp = dirblock(dp, dp->size / BSIZE)) == 0)
+    return 0;
+  h = DIRHDRP(bp, 0);
+  h->magic = DIRMAGIC;
+  h->depth = depth;
+  dp->size += BSIZE;
+  iupdate(dp);
+  return bp;
+}
+
+// Give a new hashed directory block 0 and one empty bucket.
+static int
+hdirinit(struct inode *dp)
+{
+  struct buf *bp, *b1;
+  struct dirhdr *h;
+
+  if((bp = dirblock(dp, 0)) == 0)
+    return -1;
+  dp->size = BSIZE;
+  if((b1 = hdirgrow(dp, 0)) == 0){
+    dp->size = 0;
+    brelse(bp);
+    return -1;
+  }
+  h = DIRHDRP(bp, DIRHDR);
+  h->magic = DIRMAGIC;
+  h->depth = 0;
+  *dirtab(bp, 0) = 1;
+  log_write(bp);
+  log_write(b1);
+  brelse(b1);
+  brelse(bp);
+  return 0;
+}
+
+// Split full bucket fb in two by the next bit of the hash,
+// doubling the table first if the bucket is as deep as it.
+// Returns -1 if the table is as deep as it can be or the disk
+// is full.
+static int
+hdirsplit(struct inode *dp, uint fb)
+{
+  struct buf *bp0, *bp, *nbp;
+  struct dirent *de, *nde;
+  uint i, k, nfb, depth, ntab;
+
+  bp0 = dirblock(dp, 0);
+  depth = DIRHDRP(bp0, DIRHDR)->depth;
+  bp = dirblock(dp, fb);
+  k = DIRHDRP(bp, 0)->depth;
+  if(k == depth && depth == DIRMAXDEPTH){
+    brelse(bp);
+    brelse(bp0);
+    return -1;
+  }
+  nfb = dp->size / BSIZE;
+  if((nbp = hdirgrow(dp, k + 1)) == 0){
+    brelse(bp);
+    brelse(bp0);
+    return -1;
+  }
+  DIRHDRP(bp, 0)->depth = k + 1;
+
+  ntab = 1 << depth;
+  if(k == depth){
+    for(i = 0; i < ntab; i++)
+      *dirtab(bp0, ntab + i) = *dirtab(bp0, i);
+    ntab *= 2;
+    DIRHDRP(bp0, DIRHDR)->depth = depth + 1;
+  }
+  for(i = 0; i < ntab; i++)
+    if(*dirtab(bp0, i) == fb && (i >> k) & 1)
+      *dirtab(bp0, i) = nfb;
+
+  // move the entries whose new bit is set.
+  de = (struct dirent*)bp->data;
+  nde = (struct dirent*)nbp->data + 1;
+  for(i = 1; i < DPB; i++){
+    if(de[i].inum && (dirhash(de[i].name) >> k) & 1){
+      *nde++ = de[i];
+      memset(&de[i], 0, sizeof(de[i]));
+    }
+  }
+  log_write(nbp);
+  log_write(bp);
+  log_write(bp0);
+  brelse(nbp);
+  brelse(bp);
+  brelse(bp0);
+  return 0;
+}
+
+// Put (name, inum) in the first free entry from lo to hi of the
+// directory block in bp. Returns -1 if there is none.
+static int
+dirput(struct buf *bp, int lo, int hi, char *name, uint inum)
+{
+  struct dirent *de = (struct dirent*)bp->data;
+  int i;
+
+  for(i = lo; i < hi; i++){
+    if(de[i].inum == 0){
+      strncpy(de[i].name, name, DIRSIZ);
+      de[i].inum = inum;
+      log_write(bp);
+      return 0;
+    }
+  }
+  return -1;
+}
+
+// Put (name, inum) in the bucket chain starting at block fb.
+// If it is full, returns -1 and sets *last to its last block.
+static int
+hdirput(struct inode *dp, uint fb, char *name, uint inum, uint *last)
+{
+  struct buf *bp;
+  uint next;
+
+  for(;;){
+    bp = dirblock(dp, fb);
+    if(dirput(bp, 1, DPB, name, inum) == 0){
+      brelse(bp);
+      return 0;
+    }
+    next = DIRHDRP(bp, 0)->next;
+    brelse(bp);
+    if(next == 0){
+      *last = fb;
+      return -1;
+    }
+    fb = next;
+  }
+}
+
+// Blocks to reserve for an FS call that adds a directory entry:
+// in a hashed directory that may split a bucket and chain a
+// block (see hdirlink()), more than MAXOPBLOCKS. initlog()
+// makes sure a file system with hashed directories has a log
+// that allows it.
+int
+dirop_blocks(void)
+{
+  return (sb.features & FS_HASHDIR) ? DIROPBLOCKS : MAXOPBLOCKS;
+}
+
+// Add (name, inum) to hashed directory dp. If its bucket is
+// full, split the bucket and try again, or else chain another
+// block to it. Never more than one of each, so that the blocks
+// written are bounded: appending a block writes it, up to two
+// bitmap blocks, the inode and up to EXTDEPTH+1 extent nodes
+// (or three indirect blocks), about ten; add the old bucket
+// and block 0. Callers reserve DIROPBLOCKS, which leaves room
+// for creating the inode being linked, and a new directory's
+// first two blocks, as well.
+static int
+hdirlink(struct inode *dp, char *name, uint inum)
+{
+  struct buf *bp, *nbp;
+  uint h, fb, last;
+  int r;
+
+  if(dp->size == 0 && hdirinit(dp) < 0)
+    return -1;
+
+  if(namecmp(name, ".") == 0 || namecmp(name, "..") == 0){
+    bp = dirblock(dp, 0);
+    r = dirput(bp, 0, 2, name, inum);
+    brelse(bp);
+    return r;
+  }
+
+  h = dirhash(name);
+  fb = hdirbucket(dp, h);
+  if(hdirput(dp, fb, name, inum, &last) == 0)
+    return 0;
+  if(last == fb && hdirsplit(dp, fb) == 0 &&
+     hdirput(dp, hdirbucket(dp, h), name, inum, &last) == 0)
+    return 0;
+
+  bp = dirblock(dp, last);
+  if((nbp = hdirgrow(dp, DIRHDRP(bp, 0)->depth)) == 0){
+    brelse(bp);
+    return -1;
+  }
+  DIRHDRP(bp, 0)->next = dp->size / BSIZE - 1;
+  log_write(bp);
+  brelse(bp);
+  dirput(nbp, 1, DPB, name, inum);
+  brelse(nbp);
+  return 0;
+}
+
 // Look for a directory entry in a directory.
 // If found, set *poff to byte offset of entry.
 struct inode*
@@ -557,6 +1628,12 @@ dirlookup(struct inode *dp, char *name, uint *poff)
   if(dp->type != T_DIR)
     panic("dirlookup not DIR");
 
+  if(dp->flags & DI_HASHDIR){
+    if((inum = hdirlookup(dp, name, poff)) == 0)
+      return 0;
+    return iget(dp->dev, inum);
+  }
+
   for(off = 0; off < dp->size; off += sizeof(de)){
     if(readi(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
       panic("dirlookup read");
@@ -589,6 +1666,11 @@ dirlink(struct inode *dp, char *name, uint inum)
     return -1;
   }
 
+  dcache_remove(dp->dev, dp->inum, name);  // may be a negative entry
+
+  if(dp->flags & DI_HASHDIR)
+    return hdirlink(dp, name, inum);
+
   // Look for an empty dirent.
   for(off = 0; off < dp->size; off += sizeof(de)){
     if(readi(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
@@ -659,6 +1741,15 @@ namex(char *path, int nameiparent, char *name)
     ip = idup(myproc()->cwd);
 
   while((path = skipelem(path, name)) != 0){
+    // a cached lookup needs no lock on the directory.
+    if(!(nameiparent && *path == '\0') &&
+       dcache_lookup(ip->dev, ip->inum, name, &next)){
+      iput(ip);
+      if(next == 0)
+        return 0;
+      ip = next;
+      continue;
+    }
     ilock(ip);
     if(ip->type != T_DIR){
       iunlockput(ip);
@@ -669,7 +1760,9 @@ namex(char *path, int nameiparent, char *name)
       iunlock(ip);
       return ip;
     }
-    if((next = dirlookup(ip, name, 0)) == 0){
+    next = dirlookup(ip, name, 0);
+    dcache_enter(ip->dev, ip->inum, name, next ? next->inum : 0);
+    if(next == 0){
       iunlockput(ip);
       return 0;
     }
@@ -3,12 +3,26 @@
 
 
 #define ROOTINO  1   // root i-number
-#define BSIZE 1024  // block size
+
+// Block size. mkfs picks one (DEFBSIZE unless told otherwise)
+// and records it in the super block. The kernel is compiled
+// with BSIZE defined as the variable it reads it into; other
+// programs get the default.
+#define DEFBSIZE 1024
+#define MAXBSIZE 4096  // a page
+#ifndef BSIZE
+#define BSIZE DEFBSIZE
+#endif
 
 // Disk layout:
 // [ boot block | super block | log | inode blocks |
 //                                          free bit map | data blocks]
 //
+// The super block is always SBOFF bytes into the disk, so that
+// it can be read before the block size is known; with blocks
+// bigger than that it shares block 0 with the boot block.
+#define SBOFF 1024
+
 // mkfs computes the super block and builds an initial file system. The
 // super block describes the disk layout:
 struct superblock {
@@ -20,13 +34,22 @@ struct superblock {
   uint logstart;     // Block number of first log block
   uint inodestart;   // Block number of first inode block
   uint bmapstart;    // Block number of first free map block
+  uint features;     // FS_* flags
+  uint bsize;        // Block size in bytes; 0 means DEFBSIZE
 };
 
 #define FSMAGIC 0x10203040
 
+#define FS_EXTENTS 0x1  // new inodes are extent-mapped
+#define FS_HASHDIR 0x2  // new directories are hashed
+#define FS_INLINE  0x4  // small files keep their data in the inode
+
+#define NADDR 28
 #define NDIRECT 12
 #define NINDIRECT (BSIZE / sizeof(uint))
-#define MAXFILE (NDIRECT + NINDIRECT)
+#define NDINDIRECT (NINDIRECT * NINDIRECT)
+#define NTINDIRECT (NDINDIRECT * NINDIRECT)
+#define MAXFILE (NDIRECT + NINDIRECT + NDINDIRECT + NTINDIRECT)
 
 // On-disk inode structure
 struct dinode {
@@ -35,9 +58,47 @@ struct dinode {
   short minor;          // Minor device number (T_DEVICE only)
   short nlink;          // Number of links to inode in file system
   uint size;            // Size of file (bytes)
-  uint addrs[NDIRECT+1];   // Data block addresses
+  uint flags;           // DI_* flags
+  uint addrs[NADDR];    // Data block addresses, or extent tree root
 };
 
+#define DI_EXTENTS 0x1  // addrs holds an extent tree root
+#define DI_HASHDIR 0x2  // a hashed directory
+#define DI_INLINE  0x4  // addrs holds the file's data
+
+// Inline inodes: the file's data, at most NINLINE bytes, is in
+// addrs itself. A file that grows past that is moved to a block
+// (extent- or block-mapped, as the file system's new inodes are).
+#define NINLINE (NADDR*sizeof(uint))
+
+// Block-mapped inodes: the first NDIRECT entries of addrs are
+// data block addresses, entry NDIRECT is that of a block holding
+// NINDIRECT more, entry NDIRECT+1 that of a doubly indirect
+// block (a block of indirect blocks) and entry NDIRECT+2 that
+// of a triply indirect block.
+//
+// Extent-mapped inodes: addrs holds the root node of a tree
+// mapping runs of logical blocks to runs of disk blocks. A node
+// is a header followed by entries sorted by lblk; in a leaf each
+// entry is an extent, in an interior node each entry points to
+// the child node covering blocks from its lblk on. Interior
+// nodes are whole disk blocks.
+struct exthdr {
+  ushort n;             // entries in use
+  ushort depth;         // 0 for a leaf
+};
+
+struct extent {
+  uint lblk;            // first logical block
+  uint pblk;            // first disk block, or child node
+  uint len;             // number of blocks; 0 in interior nodes
+};
+
+// Extent entries in the inode, and in a node block.
+#define NEXTROOT ((NADDR*sizeof(uint) - sizeof(struct exthdr)) / sizeof(struct extent))
+#define NEXTNODE ((BSIZE - sizeof(struct exthdr)) / sizeof(struct extent))
+#define EXTDEPTH 4      // deepest extent tree
+
 // Inodes per block.
 #define IPB           (BSIZE / sizeof(struct dinode))
 
@@ -58,3 +119,27 @@ struct dirent {
   char name[DIRSIZ];
 };
 
+// A hashed directory is still an array of dirents, so programs
+// that read directories see every entry, but entries are placed
+// by a hash of their name (extendible hashing):
+//   block 0:  ".", "..", a header, then the bucket table.
+//   block b:  a header, then the entries of bucket b.
+// Headers and table slots have inum 0, so readers skip them.
+// The table has 1 << depth entries, each the block number of
+// a bucket; entry (hash & (1<<depth)-1) is the bucket for a
+// name. A full bucket is split in two, doubling the table if
+// it is already as deep as the table, and once the table is
+// DIRMAXDEPTH deep full buckets are chained instead.
+struct dirhdr {
+  ushort inum;          // always 0
+  ushort magic;         // DIRMAGIC
+  ushort depth;         // table depth (block 0), or bucket's depth
+  ushort next;          // next block of this bucket's chain, or 0
+  uint unused[2];
+};
+
+#define DIRMAGIC 0x6864
+#define DIRHDR 2        // entry of block 0 holding its header
+#define DIRTAB 3        // first entry of block 0 holding the table
+#define DIRTABPER (DIRSIZ / sizeof(ushort))  // table slots per entry
+#define DIRMAXDEPTH 8
@@ -0,0 +1,133 @@
+// Block I/O scheduler.
+//
+// Sits between the buffer cache and the virtio disk driver.
+// bio.c hands it batches of bufs to read or write; it keeps
+// them on a queue sorted by block number and dispatches them to
+// the driver in elevator (C-LOOK) order: ascending from the
+// block after the previous request, wrapping around to the
+// lowest pending block. Runs of pending requests for adjacent
+// blocks in the same direction are merged into a single
+// multi-block virtio request, up to MAXMERGE blocks.
+//
+// Dispatch happens when requests are submitted and, from
+// virtio_disk_intr(), whenever the device completes requests
+// and frees descriptors. A buf has b->disk set from submission
+// until the device is done with it; virtio_disk_wait() waits
+// for that.
+//
+// Lock order: ioq.lock, then the driver's lock.
+
+#include "types.h"
+#include "param.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "riscv.h"
+#include "defs.h"
+#include "fs.h"
+#include "buf.h"
+#include "virtio.h"
+
+#define MAXMERGE MAXSEG   // most blocks in one merged request
+
+struct {
+  struct spinlock lock;
+  struct buf *queue;   // pending bufs, sorted by (dev, blockno)
+  uint dev;            // where the elevator is
+  uint pos;
+} ioq;
+
+void
+iosched_init(void)
+{
+  initlock(&ioq.lock, "ioq");
+}
+
+static int
+before(struct buf *a, uint dev, uint blockno)
+{
+  return a->dev < dev || (a->dev == dev && a->blockno < blockno);
+}
+
+// insert b into the sorted queue. Caller holds ioq.lock.
+static void
+enqueue(struct buf *b)
+{
+  struct buf **pp;
+
+  for(pp = &ioq.queue; *pp && before(*pp, b->dev, b->blockno); pp = &(*pp)->qnext)
+    ;
+  b->qnext = *pp;
+  *pp = b;
+}
+
+// Hand runs of queued requests to the driver, in elevator
+// order, until the queue is empty or the driver has no room.
+void
+iosched_dispatch(void)
+{
+  struct buf **pp, **start, *b, *last;
+  int n;
+
+  acquire(&ioq.lock);
+  while(ioq.queue){
+    // first pending request at or after the elevator position,
+    // or else the lowest one.
+    for(start = &ioq.queue; *start && before(*start, ioq.dev, ioq.pos); start = &(*start)->qnext)
+      ;
+    if(*start == 0)
+      start = &ioq.queue;
+
+    // extend the run while the next request is for the next
+    // block in the same direction.
+    last = *start;
+    n = 1;
+    for(pp = &last->qnext; *pp && n < MAXMERGE; pp = &last->qnext){
+      b = *pp;
+      if(b->dev != last->dev || b->blockno != last->blockno + 1 ||
+         b->qwrite != last->qwrite)
+        break;
+      last = b;
+      n++;
+    }
+
+    // detach the run [*start, last] from the queue.
+    b = *start;
+    *start = last->qnext;
+    last->qnext = 0;
+    if(virtio_disk_start(b, n, b->qwrite) < 0){
+      // no descriptors; put it back and wait for completions.
+      last->qnext = *start;
+      *start = b;
+      break;
+    }
+    ioq.dev = last->dev;
+    ioq.pos = last->blockno + 1;
+  }
+  release(&ioq.lock);
+}
+
+// Queue reads (write==0) or writes of n bufs and start as many
+// as the device can take, without waiting for them to finish.
+// Wait for each buf with virtio_disk_wait().
+void
+iosched_submit(struct buf **bs, int n, int write)
+{
+  int i;
+
+  acquire(&ioq.lock);
+  for(i = 0; i < n; i++){
+    bs[i]->disk = 1;
+    bs[i]->qwrite = write;
+    enqueue(bs[i]);
+  }
+  release(&ioq.lock);
+  iosched_dispatch();
+}
+
+// Read or write one buf and wait for it.
+void
+iosched_rw(struct buf *b, int write)
+{
+  iosched_submit(&b, 1, write);
+  virtio_disk_wait(b);
+}
@@ -1,6 +1,19 @@
 // Physical memory allocator, for user processes,
 // kernel stacks, page-table pages,
 // and pipe buffers. Allocates whole 4096-byte pages.
+//
+// Free pages live in two tiers: a small per-CPU cache that
+// kalloc() and kfree() use almost all of the time, and the
+// buddy allocator in buddy.c, which the caches refill from and
+// drain to in batches of KMEM_BATCH pages. A CPU's cache lock is
+// only ever taken by that CPU, except when another CPU finds
+// both its own cache and the buddy pool empty and steals half of
+// the fullest cache; so in the common case the lock is never
+// contended and no cache line bounces between harts.
+//
+// A page can be shared, copy-on-write, between user page tables
+// and pipes (see pipe.c); kdup() counts the extra references,
+// and kfree() only frees the page once the last one is dropped.
 
 #include "types.h"
 #include "param.h"
@@ -9,6 +22,9 @@
 #include "riscv.h"
 #include "defs.h"
 
+#define KMEM_BATCH  32               // pages moved per refill/drain
+#define KMEM_HIGH   (2*KMEM_BATCH)   // drain a cache above this
+
 void freerange(void *pa_start, void *pa_end);
 
 extern char end[]; // first address after kernel.
@@ -18,25 +34,91 @@ struct run {
   struct run *next;
 };
 
-struct {
+// extra references to each page, by kdup().
+static uint kshare[(PHYSTOP - KERNBASE) / PGSIZE];
+#define KSHARE(pa) (&kshare[((uint64)(pa) - KERNBASE) / PGSIZE])
+
+// per-CPU caches.
+struct kmem_cpu {
   struct spinlock lock;
   struct run *freelist;
-} kmem;
+  int nfree;
+} kcpu[NCPU];
 
 void
 kinit()
 {
-  initlock(&kmem.lock, "kmem");
+  for(int i = 0; i < NCPU; i++)
+    initlock(&kcpu[i].lock, "kmem_cpu");
   freerange(end, (void*)PHYSTOP);
 }
 
 void
 freerange(void *pa_start, void *pa_end)
 {
-  char *p;
-  p = (char*)PGROUNDUP((uint64)pa_start);
-  for(; p + PGSIZE <= (char*)pa_end; p += PGSIZE)
-    kfree(p);
+  // all of memory starts out in the buddy allocator rather
+  // than in the cache of the CPU that happens to run kinit().
+  buddyinit(pa_start, pa_end);
+}
+
+// Move up to n pages from the front of list *from (of length
+// *nfrom) to the front of list *to. Returns the number moved.
+static int
+kmove(struct run **from, int *nfrom, struct run **to, int *nto, int n)
+{
+  struct run *first, *last;
+  int i;
+
+  if(*from == 0 || n <= 0)
+    return 0;
+  first = last = *from;
+  for(i = 1; i < n && last->next; i++)
+    last = last->next;
+  *from = last->next;
+  *nfrom -= i;
+  last->next = *to;
+  *to = first;
+  *nto += i;
+  return i;
+}
+
+// Steal half of the fullest other CPU's cache, keep one page
+// for the caller and put the rest in kc.
+// Called with interrupts off and no cache lock held; never
+// holding two cache locks at once means steals in opposite
+// directions cannot deadlock.
+static struct run*
+ksteal(struct kmem_cpu *kc)
+{
+  struct kmem_cpu *victim, *v;
+  struct run *batch, *r;
+  int n;
+
+  batch = 0;
+  n = 0;
+  while(batch == 0){
+    // nfree is read without the lock; it is only a hint, and
+    // the victim may have emptied by the time we lock it.
+    victim = 0;
+    for(v = kcpu; v < kcpu + NCPU; v++){
+      if(v != kc && v->nfree > 0 && (victim == 0 || v->nfree > victim->nfree))
+        victim = v;
+    }
+    if(victim == 0)
+      return 0;
+    acquire(&victim->lock);
+    kmove(&victim->freelist, &victim->nfree, &batch, &n, (victim->nfree + 1) / 2);
+    release(&victim->lock);
+  }
+
+  r = batch;
+  batch = r->next;
+  n--;
+
+  acquire(&kc->lock);
+  kmove(&batch, &n, &kc->freelist, &kc->nfree, n);
+  release(&kc->lock);
+  return r;
 }
 
 // Free the page of physical memory pointed at by pa,
@@ -46,20 +128,42 @@ freerange(void *pa_start, void *pa_end)
 void
 kfree(void *pa)
 {
-  struct run *r;
+  struct run *r, *batch;
+  struct kmem_cpu *kc;
+  int n;
 
   if(((uint64)pa % PGSIZE) != 0 || (char*)pa < end || (uint64)pa >= PHYSTOP)
     panic("kfree");
 
+  // drop a reference of a shared page. Whoever takes the count
+  // below zero held the last one, and frees it.
+  if(*KSHARE(pa) != 0){
+    if(__sync_fetch_and_sub(KSHARE(pa), 1) != 0)
+      return;
+    *KSHARE(pa) = 0;
+  }
+
   // Fill with junk to catch dangling refs.
   memset(pa, 1, PGSIZE);
 
   r = (struct run*)pa;
 
-  acquire(&kmem.lock);
-  r->next = kmem.freelist;
-  kmem.freelist = r;
-  release(&kmem.lock);
+  push_off();
+  kc = &kcpu[cpuid()];
+  acquire(&kc->lock);
+  r->next = kc->freelist;
+  kc->freelist = r;
+  kc->nfree++;
+  batch = 0;
+  if(kc->nfree > KMEM_HIGH){
+    // give a batch back so other CPUs can refill from it.
+    n = 0;
+    kmove(&kc->freelist, &kc->nfree, &batch, &n, KMEM_BATCH);
+  }
+  release(&kc->lock);
+  if(batch)
+    buddy_give(batch);
+  pop_off();
 }
 
 // Allocate one 4096-byte page of physical memory.
@@ -69,14 +173,75 @@ void *
 kalloc(void)
 {
   struct run *r;
+  struct kmem_cpu *kc;
 
-  acquire(&kmem.lock);
-  r = kmem.freelist;
-  if(r)
-    kmem.freelist = r->next;
-  release(&kmem.lock);
+  push_off();
+  kc = &kcpu[cpuid()];
+  acquire(&kc->lock);
+  if(kc->freelist == 0){
+    kc->freelist = buddy_take(KMEM_BATCH, &kc->nfree);
+  }
+  r = kc->freelist;
+  if(r){
+    kc->freelist = r->next;
+    kc->nfree--;
+  }
+  release(&kc->lock);
+  if(r == 0)
+    r = ksteal(kc);
+  pop_off();
 
   if(r)
     memset((char*)r, 5, PGSIZE); // fill with junk
   return (void*)r;
 }
+
+// kalloc(), but if memory has run out, first try to get some
+// back from the inode table and the slab caches. That takes
+// their locks, so kalloc() itself never does it; the caller
+// must hold no spinlocks.
+void *
+kalloc_reclaim(void)
+{
+  void *pa;
+
+  if((pa = kalloc()) == 0){
+    ishrink();  // free cached inodes, so their slabs may empty
+    if(kmem_cache_reap() > 0)
+      pa = kalloc(); // slab caches gave some pages back
+  }
+  return pa;
+}
+
+// Add a reference to page pa, which kfree() will drop.
+void
+kdup(void *pa)
+{
+  __sync_fetch_and_add(KSHARE(pa), 1);
+}
+
+// Does page pa have more than one reference?
+int
+kshared(void *pa)
+{
+  return *KSHARE(pa) != 0;
+}
+
+// Return every page held in the per-CPU caches to the buddy
+// allocator, so that they can merge into larger blocks.
+void
+kmem_flush(void)
+{
+  struct kmem_cpu *kc;
+  struct run *batch;
+
+  for(kc = kcpu; kc < kcpu + NCPU; kc++){
+    acquire(&kc->lock);
+    batch = kc->freelist;
+    kc->freelist = 0;
+    kc->nfree = 0;
+    release(&kc->lock);
+    if(batch)
+      buddy_give(batch);
+  }
+}
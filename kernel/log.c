@@ -3,6 +3,7 @@
 #include "defs.h"
 #include "param.h"
 #include "spinlock.h"
+#include "proc.h"
 #include "sleeplock.h"
 #include "fs.h"
 #include "buf.h"
@@ -10,29 +11,80 @@
 // Simple logging that allows concurrent FS system calls.
 //
 // A log transaction contains the updates of multiple FS system
-// calls. The logging system only commits when there are
-// no FS system calls active. Thus there is never
+// calls. A transaction is only closed when there are no FS
+// system calls active in it. Thus there is never
 // any reasoning required about whether a commit might
 // write an uncommitted system call's updates to disk.
 //
 // A system call should call begin_op()/end_op() to mark
 // its start and end. Usually begin_op() just increments
 // the count of in-progress FS system calls and returns.
-// But if it thinks the log is close to running out, it
-// sleeps until the last outstanding end_op() commits.
+// But if it thinks the transaction is close to running out
+// of room, it sleeps until the open transaction has been closed.
 //
-// The log is a physical re-do log containing disk blocks.
-// The on-disk log format:
-//   header block, containing block #s for block A, B, C, ...
-//   block A
-//   block B
-//   block C
-//   ...
-// Log appends are synchronous.
-
-// Contents of the header block, used for both the on-disk header block
-// and to keep track in memory of logged block# before commit.
+// The log is double-buffered. At most one closed transaction
+// is being committed (written to the log) at a time, while new
+// FS system calls join the next, open one. Closing a
+// transaction copies its blocks out of the buffer cache, so
+// later transactions may modify them while the commit writes
+// the copies. The last end_op() of a transaction closes and
+// commits it, after waiting up to LOGDELAY ticks for more
+// calls to join; if a commit is already running, its committer
+// picks up the next transaction when it finishes. end_op()
+// returns once its transaction has been committed, if the call
+// wrote anything; a call that did not (a read, say) neither
+// waits for the commit nor does it, leaving that to one that
+// did.
+//
+// Committed transactions are installed to their home locations
+// later, by the logckpt kernel thread, which reads them back
+// from the log. Until then their blocks stay pinned in the
+// buffer cache, which therefore always holds the latest
+// contents of any block not yet installed.
+//
+// Only metadata is logged. The data of regular files is written
+// back from the buffer cache (see bdirty() in bio.c), except
+// for blocks that still have log copies to install; blocks just
+// added to files are written back before the commit that adds
+// them (ordered mode).
+//
+// The log is a physical re-do log containing disk blocks,
+// used as a circular buffer. The on-disk log format:
+//   header block: the slot and sequence number of the oldest
+//     transaction not yet installed
+//   slots, each holding one block:
+//     descriptor: magic, sequence number, block #s for A, B, ...
+//     block A
+//     block B
+//     ...
+//     next descriptor ...
+// A transaction's blocks are written first and its descriptor
+// last; writing the descriptor commits it. Recovery replays
+// transactions starting at the header's slot for as long as it
+// finds descriptors with the next sequence number. So that a
+// stale data block can never pass for a descriptor, logged
+// blocks that begin with LOGMAGIC are written with that word
+// cleared and their descriptor entry marked LOGESC.
+
+#define LOGMAGIC 0x4c4f4721             // descriptor block
+#define LOGESC   0x80000000             // block began with LOGMAGIC
+
+// On-disk header block.
 struct logheader {
+  uint tail;       // slot of the oldest uninstalled transaction
+  uint seq;        // its sequence number
+};
+
+// On-disk descriptor block, one per transaction.
+struct logdesc {
+  uint magic;      // LOGMAGIC
+  uint seq;
+  int n;
+  uint block[LOGSIZE];
+};
+
+// In memory, the block #s logged by a transaction.
+struct logtrans {
   int n;
   int block[LOGSIZE];
 };
@@ -41,170 +93,447 @@ struct log {
   struct spinlock lock;
   int start;
   int size;
+  int nslot;       // log blocks after the header.
+  int window;      // most slots in use, to bound pinned bufs.
+  int max;         // most blocks in one transaction.
   int outstanding; // how many FS sys calls are executing.
-  int committing;  // in commit(), please wait.
+  int reserved;    // blocks they may write in all.
+  int committing;  // a closed transaction is being committed.
+  int closing;     // copying it out of the cache; begin_op() waits.
+  int grouping;    // an end_op() is waiting for more calls to join.
   int dev;
-  struct logheader lh;
+  uint seq;        // sequence number of the open transaction.
+  uint done;       // ... of the last transaction committed.
+  struct logtrans lh;   // open transaction.
+  struct logtrans ch;   // committing transaction.
+
+  // the log's committed, uninstalled transactions.
+  int tail;        // slot of the oldest.
+  uint tailseq;    // its sequence number.
+  int used;        // slots they occupy.
+  int ckwant;      // a commit is waiting for logckpt to free slots.
+
+  // private bufs for log I/O, not in the buffer cache.
+  // copy and ibuf have max bufs each.
+  struct buf cdesc, copy[LOGSIZE];  // commit
+  struct buf idesc, ibuf[LOGSIZE];  // install
+
+  // statistics, for log_dump().
+  uint64 nops;     // end_op() calls
+  uint64 ncommit;  // transactions committed
+  uint64 nblocks;  // blocks committed
+  uint64 nwait;    // times begin_op() or a commit had to sleep
+  uint64 nckpt;    // checkpoints by logckpt
 };
 struct log log;
 
 static void recover_from_log(void);
-static void commit();
+static void logckpt(void);
 
 void
 initlog(int dev, struct superblock *sb)
 {
-  if (sizeof(struct logheader) >= BSIZE)
-    panic("initlog: too big logheader");
+  if (sizeof(struct logdesc) >= BSIZE)
+    panic("initlog: too big logdesc");
 
   initlock(&log.lock, "log");
   log.start = sb->logstart;
   log.size = sb->nlog;
   log.dev = dev;
+  log.nslot = log.size - 1;
+
+  // size the log's use of the buffer cache to the cache, which
+  // must also hold the open and the committing transaction and
+  // the blocks in use by FS system calls.
+  log.window = log.nslot;
+  if(log.window > nbuf/2)
+    log.window = nbuf/2;
+  log.max = log.window - 1;   // leave room for the descriptor
+  if(log.max > nbuf/8)
+    log.max = nbuf/8;
+  if(log.max > LOGSIZE)
+    log.max = LOGSIZE;
+  if(log.max < MAXOPBLOCKS)
+    panic("initlog: log too small");
+  if((sb->features & FS_HASHDIR) && log_maxop() < DIROPBLOCKS)
+    panic("initlog: log too small for hashed directories");
+  bufinit(&log.cdesc, 1, dev);
+  bufinit(&log.idesc, 1, dev);
+  bufinit(log.copy, log.max, dev);
+  bufinit(log.ibuf, log.max, dev);
   recover_from_log();
+  if(kthread(logckpt, "logckpt") < 0)
+    panic("initlog: logckpt");
+}
+
+// disk block number of log slot i.
+static uint
+slot(int i)
+{
+  return log.start + 1 + i % log.nslot;
 }
 
-// Copy committed blocks from log to their home location
+// Read (write==0) or write n private bufs at their blocknos,
+// all in flight at once.
 static void
-install_trans(int recovering)
+log_rw(struct buf *b, int n, int write)
 {
-  int tail;
+  struct buf *bs[16];
+  int i, k;
 
-  for (tail = 0; tail < log.lh.n; tail++) {
-    struct buf *lbuf = bread(log.dev, log.start+tail+1); // read log block
-    struct buf *dbuf = bread(log.dev, log.lh.block[tail]); // read dst
-    memmove(dbuf->data, lbuf->data, BSIZE);  // copy block to dst
-    bwrite(dbuf);  // write dst to disk
-    if(recovering == 0)
-      bunpin(dbuf);
-    brelse(lbuf);
-    brelse(dbuf);
+  for (i = 0; i < n; i += k) {
+    for (k = 0; k < NELEM(bs) && i+k < n; k++)
+      bs[k] = &b[i+k];
+    iosched_submit(bs, k, write);
   }
+  for (i = 0; i < n; i++)
+    virtio_disk_wait(&b[i]);
 }
 
-// Read the log header from disk into the in-memory log header
+// Read the log header from disk.
 static void
-read_head(void)
+read_head(int *tail, uint *seq)
 {
   struct buf *buf = bread(log.dev, log.start);
   struct logheader *lh = (struct logheader *) (buf->data);
-  int i;
-  log.lh.n = lh->n;
-  for (i = 0; i < log.lh.n; i++) {
-    log.lh.block[i] = lh->block[i];
-  }
+  *tail = lh->tail < log.nslot ? lh->tail : 0;
+  *seq = lh->seq;
   brelse(buf);
 }
 
-// Write in-memory log header to disk.
-// This is the true point at which the
-// current transaction commits.
+// Write the log header to disk. This is the point at which
+// the transactions before tail are no longer in the log.
 static void
-write_head(void)
+write_head(int tail, uint seq)
 {
   struct buf *buf = bread(log.dev, log.start);
   struct logheader *hb = (struct logheader *) (buf->data);
-  int i;
-  hb->n = log.lh.n;
-  for (i = 0; i < log.lh.n; i++) {
-    hb->block[i] = log.lh.block[i];
-  }
+  hb->tail = tail;
+  hb->seq = seq;
   bwrite(buf);
   brelse(buf);
 }
 
+// Copy committed transactions from log to their home locations,
+// starting at slot tail with sequence number *seq, until nslot
+// slots are done or, if recovering, the log runs out, dropping
+// them from the log (each as it is done, unless recovering).
+// Returns the number of slots done and
+// sets *seq to the sequence number of the next transaction.
+static int
+install_trans(int tail, uint *seq, int nslot, int recovering)
+{
+  struct logdesc *d = (struct logdesc *) log.idesc.data;
+  int i, j, k, n, t;
+
+  for (t = 0; recovering || t < nslot; t += n+1, (*seq)++) {
+    log.idesc.blockno = slot(tail+t);
+    log_rw(&log.idesc, 1, 0); // read descriptor
+    if(d->magic != LOGMAGIC || d->seq != *seq || d->n < 1 ||
+       d->n > LOGSIZE || d->n >= log.nslot){
+      if(recovering)
+        break;  // end of committed transactions
+      panic("install_trans: bad descriptor");
+    }
+    n = d->n;
+    // the transaction may have been written by a kernel with
+    // a larger log.max; go log.max blocks at a time.
+    for (j = 0; j < n; j += k) {
+      k = n - j;
+      if(k > log.max)
+        k = log.max;
+      for (i = 0; i < k; i++)
+        log.ibuf[i].blockno = slot(tail+t+1+j+i);
+      log_rw(log.ibuf, k, 0); // read log blocks
+      for (i = 0; i < k; i++) {
+        if(d->block[j+i] & LOGESC)
+          *(uint*)log.ibuf[i].data = LOGMAGIC;
+        log.ibuf[i].blockno = d->block[j+i] & ~LOGESC;
+      }
+      log_rw(log.ibuf, k, 1); // write dsts to disk
+    }
+    if(recovering == 0){
+      // erase it from the log before unpinning its blocks: once
+      // unpinned, file data may be written to them directly,
+      // and recovery must not replay the transaction over that.
+      write_head((tail+t+n+1) % log.nslot, *seq + 1);
+      for (i = 0; i < n; i++) {
+        struct buf *b = bread(log.dev, d->block[i] & ~LOGESC);
+        bunpin(b);
+        brelse(b);
+      }
+    }
+  }
+  if(recovering)
+    write_head((tail+t) % log.nslot, *seq); // erase them from the log
+  return t;
+}
+
 static void
 recover_from_log(void)
 {
-  read_head();
-  install_trans(1); // if committed, copy from log to disk
-  log.lh.n = 0;
-  write_head(); // clear the log
+  int tail;
+  uint seq;
+
+  read_head(&tail, &seq);
+  log.tail = (tail + install_trans(tail, &seq, 0, 1)) % log.nslot;
+  log.tailseq = seq;
+  log.used = 0;
+  log.seq = log.tailseq;
+  log.done = log.seq - 1;
+}
+
+// The logckpt kernel thread. Lazily installs committed
+// transactions, once half the log window is in use or a commit
+// needs room, so that FS system calls only pay for the log
+// writes.
+static void
+logckpt(void)
+{
+  int tail, n;
+  uint seq;
+
+  acquire(&log.lock);
+  for(;;){
+    while(!log.ckwant && log.used <= log.window/2)
+      sleep(&log.tail, &log.lock);
+    log.ckwant = 0;
+    tail = log.tail;
+    seq = log.tailseq;
+    n = log.used;
+    release(&log.lock);
+
+    n = install_trans(tail, &seq, n, 0);
+
+    acquire(&log.lock);
+    log.tail = (tail + n) % log.nslot;
+    log.tailseq = seq;
+    log.used -= n;
+    log.nckpt++;
+    wakeone(&log.used);  // commit(), if waiting for room
+  }
 }
 
 // called at the start of each FS system call.
 void
 begin_op(void)
+{
+  begin_opn(MAXOPBLOCKS);
+}
+
+// called at the start of an FS system call that may write up
+// to nblocks blocks, at most log_maxop().
+void
+begin_opn(int nblocks)
 {
   acquire(&log.lock);
   while(1){
-    if(log.committing){
+    if(log.closing){
+      log.nwait++;
       sleep(&log, &log.lock);
-    } else if(log.lh.n + (log.outstanding+1)*MAXOPBLOCKS > LOGSIZE){
-      // this op might exhaust log space; wait for commit.
+    } else if(log.lh.n + log.reserved + nblocks > log.max){
+      // this op might overflow the transaction; wait for commit.
+      log.nwait++;
       sleep(&log, &log.lock);
     } else {
       log.outstanding += 1;
+      log.reserved += nblocks;
+      myproc()->oplogged = 0;
       release(&log.lock);
       break;
     }
   }
 }
 
-// called at the end of each FS system call.
-// commits if this was the last outstanding operation.
-void
-end_op(void)
+// The most blocks one FS system call may reserve with
+// begin_opn(): half a transaction, so that two such calls
+// can share a commit.
+int
+log_maxop(void)
 {
-  int do_commit = 0;
+  return log.max/2 > MAXOPBLOCKS ? log.max/2 : MAXOPBLOCKS;
+}
+
+// Sequence number of the open transaction, which is the
+// caller's: it cannot close while the caller is between
+// begin_op() and end_op().
+uint
+log_opseq(void)
+{
+  return log.seq;
+}
+
+// Can the open transaction be closed and committed now?
+// Caller holds log.lock.
+static int
+can_close(void)
+{
+  return log.outstanding == 0 && log.lh.n > 0 &&
+         !log.committing && !log.grouping;
+}
+
+#if LOGDELAY > 0
+// Give other FS system calls up to LOGDELAY ticks to join the
+// open transaction, so that they share one commit.
+// Caller holds log.lock.
+static void
+group_wait(void)
+{
+  uint t0 = ticks;
+
+  log.grouping = 1;
+  while(ticks - t0 < LOGDELAY && log.lh.n + MAXOPBLOCKS <= log.max)
+    sleep(&ticks, &log.lock);
+  log.grouping = 0;
+}
+#endif
+
+// Write the closed transaction log.ch, whose blocks have been
+// copied to log.copy, at the head of the log.
+// Caller holds log.lock; releases it while writing.
+static void
+commit(uint seq)
+{
+  struct logdesc *d = (struct logdesc *) log.cdesc.data;
+  int head, i, n;
+
+  n = log.ch.n;
+  while(log.window - log.used < n+1){
+    // wait for logckpt to install old transactions.
+    log.ckwant = 1;
+    log.nwait++;
+    wakeone(&log.tail);
+    sleep(&log.used, &log.lock);
+  }
+  head = (log.tail + log.used) % log.nslot;
+  release(&log.lock);
+
+  d->magic = LOGMAGIC;
+  d->seq = seq;
+  d->n = n;
+  for (i = 0; i < n; i++) {
+    d->block[i] = log.ch.block[i];
+    if(*(uint*)log.copy[i].data == LOGMAGIC){
+      *(uint*)log.copy[i].data = 0;
+      d->block[i] |= LOGESC;
+    }
+    log.copy[i].blockno = slot(head+1+i);
+  }
+  log_rw(log.copy, n, 1);   // Write modified blocks to log
+  log.cdesc.blockno = slot(head);
+  log_rw(&log.cdesc, 1, 1); // Write descriptor -- the real commit
 
   acquire(&log.lock);
-  log.outstanding -= 1;
-  if(log.committing)
-    panic("log.committing");
-  if(log.outstanding == 0){
-    do_commit = 1;
+  log.used += n+1;
+  if(log.used > log.window/2)
+    wakeone(&log.tail);
+}
+
+// Close and commit the open transaction, and then any that
+// are ready by the time that is done.
+// Caller holds log.lock, and can_close() is true; releases it
+// while committing, since not allowed to sleep with locks.
+static void
+commit_all(void)
+{
+  uint seq;
+  int i;
+
+  do {
+    // close the open transaction.
+    log.ch = log.lh;
+    log.lh.n = 0;
+    seq = log.seq++;
     log.committing = 1;
-  } else {
-    // begin_op() may be waiting for log space,
-    // and decrementing log.outstanding has decreased
-    // the amount of reserved space.
+    log.closing = 1;
+    release(&log.lock);
+
+    // copy its blocks, which are pinned in the cache, so that
+    // the next transaction can modify them during the commit.
+    for (i = 0; i < log.ch.n; i++) {
+      struct buf *b = bread(log.dev, log.ch.block[i]);
+      memmove(log.copy[i].data, b->data, BSIZE);
+      brelse(b);
+    }
+
+    acquire(&log.lock);
+    log.closing = 0;
     wakeup(&log);
-  }
-  release(&log.lock);
+    release(&log.lock);
+
+    // ordered mode: file data is not logged, but blocks just
+    // added to files must hold their data before the inodes
+    // that now cover them commit.
+    bflush_ordered();
+
+    acquire(&log.lock);
+    commit(seq);
+    release(&log.lock);
+
+    // the blocks it freed may be reused now; the transaction
+    // after next, which shares their pend map, waits for
+    // log.committing to clear.
+    bfreecommit(seq);
 
-  if(do_commit){
-    // call commit w/o holding locks, since not allowed
-    // to sleep with locks.
-    commit();
     acquire(&log.lock);
     log.committing = 0;
+    log.done = seq;
+    log.ncommit++;
+    log.nblocks += log.ch.n;
     wakeup(&log);
-    release(&log.lock);
-  }
+  } while(can_close());
 }
 
-// Copy modified blocks from cache to log.
-static void
-write_log(void)
+// called at the end of each FS system call.
+// returns once the call's transaction has committed.
+void
+end_op(void)
 {
-  int tail;
-
-  for (tail = 0; tail < log.lh.n; tail++) {
-    struct buf *to = bread(log.dev, log.start+tail+1); // log block
-    struct buf *from = bread(log.dev, log.lh.block[tail]); // cache block
-    memmove(to->data, from->data, BSIZE);
-    bwrite(to);  // write the log
-    brelse(from);
-    brelse(to);
-  }
+  end_opn(MAXOPBLOCKS);
 }
 
-static void
-commit()
+// end_op() for begin_opn(nblocks).
+void
+end_opn(int nblocks)
 {
-  if (log.lh.n > 0) {
-    write_log();     // Write modified blocks from cache to log
-    write_head();    // Write header to disk -- the real commit
-    install_trans(0); // Now install writes to home locations
-    log.lh.n = 0;
-    write_head();    // Erase the transaction from the log
+  uint seq;
+  int wrote = myproc()->oplogged;
+
+  acquire(&log.lock);
+  log.outstanding -= 1;
+  log.reserved -= nblocks;
+  log.nops++;
+  seq = log.seq;
+  if(can_close() && wrote){
+#if LOGDELAY > 0
+    group_wait();
+    if(can_close())
+#endif
+      commit_all();
+  } else {
+    // begin_op() may be waiting for room,
+    // and decrementing log.reserved has decreased
+    // the amount of reserved space; and if this call
+    // wrote nothing, one that did may be waiting below
+    // for it to finish, to commit.
+    wakeup(&log);
   }
+
+  // wait for our transaction to be committed, committing
+  // it if no one else will.
+  while(wrote && (int)(log.done - seq) < 0){
+    if(can_close())
+      commit_all();
+    else
+      sleep(&log, &log.lock);
+  }
+  release(&log.lock);
 }
 
 // Caller has modified b->data and is done with the buffer.
 // Record the block number and pin in the cache by increasing refcnt.
-// commit()/write_log() will do the disk write.
+// commit() will write it to the log and logckpt will install it
+// and unpin it.
 //
 // log_write() replaces bwrite(); a typical use is:
 //   bp = bread(...)
@@ -217,7 +546,7 @@ log_write(struct buf *b)
   int i;
 
   acquire(&log.lock);
-  if (log.lh.n >= LOGSIZE || log.lh.n >= log.size - 1)
+  if (log.lh.n >= log.max)
     panic("too big a transaction");
   if (log.outstanding < 1)
     panic("log_write outside of trans");
@@ -227,6 +556,8 @@ log_write(struct buf *b)
       break;
   }
   log.lh.block[i] = b->blockno;
+  myproc()->oplogged = 1;
+  bclean(b);  // the log writes it now
   if (i == log.lh.n) {  // Add new block to log?
     bpin(b);
     log.lh.n++;
@@ -234,3 +565,15 @@ log_write(struct buf *b)
   release(&log.lock);
 }
 
+// Print group commit and checkpoint statistics.
+// For debugging; runs when user types ^P on console.
+// No lock to avoid wedging a stuck machine further.
+void
+log_dump(void)
+{
+  printf("log: ops %d commits %d blocks %d ops/commit %d waits %d\n",
+         (int)log.nops, (int)log.ncommit, (int)log.nblocks,
+         log.ncommit ? (int)(log.nops / log.ncommit) : 0, (int)log.nwait);
+  printf("log: used %d/%d slots max %d checkpoints %d\n",
+         log.used, log.window, log.max, (int)log.nckpt);
+}
@@ -17,6 +17,7 @@ main()
     printf("xv6 kernel is booting\n");
     printf("\n");
     kinit();         // physical page allocator
+    kmem_cache_init(); // slab object caches
     kvminit();       // create kernel page table
     kvminithart();   // turn on paging
     procinit();      // process table
@@ -26,7 +27,10 @@ main()
     plicinithart();  // ask PLIC for device interrupts
     binit();         // buffer cache
     iinit();         // inode table
+    dcacheinit();    // directory name lookup cache
     fileinit();      // file table
+    pipeinit();      // pipe cache
+    iosched_init();  // block I/O scheduler
     virtio_disk_init(); // emulated hard disk
     userinit();      // first user process
     __sync_synchronize();
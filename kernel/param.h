@@ -1,13 +1,19 @@
 #define NPROC        64  // maximum number of processes
 #define NCPU          8  // maximum number of CPUs
 #define NOFILE       16  // open files per process
-#define NFILE       100  // open files per system
-#define NINODE       50  // maximum number of active i-nodes
+#define NINODE       50  // unreferenced i-nodes kept cached
+#define NDENTRY     256  // cached directory name lookups
 #define NDEV         10  // maximum major device number
 #define ROOTDEV       1  // device number of file system root disk
 #define MAXARG       32  // max exec arguments
 #define MAXOPBLOCKS  10  // max # of blocks any FS op writes
-#define LOGSIZE      (MAXOPBLOCKS*3)  // max data blocks in on-disk log
-#define NBUF         (MAXOPBLOCKS*3)  // size of disk block cache
-#define FSSIZE       2000  // size of file system in blocks
+#define DIROPBLOCKS  (MAXOPBLOCKS*3)  // ... that adds a directory entry
+#define LOGSIZE      250  // max data blocks in one log transaction
+#define LOGDELAY      0  // ticks a commit waits for more FS calls to join
+#define LOGBLOCKS    (MAXOPBLOCKS*30)  // default size of on-disk log, in blocks
+#define NBUF         (MAXOPBLOCKS*12)  // minimum size of disk block cache
+#define BCACHEFRAC   32  // disk block cache gets 1/BCACHEFRAC of free memory
+#define FLUSHDELAY   30  // ticks file data may stay dirty in the cache
+#define FSSIZE       4000  // default size of file system in blocks
 #define MAXPATH      128   // maximum file path name
+#define MAXORDER     11  // kalloc_pages() blocks are up to 2^(MAXORDER-1) pages
@@ -8,17 +8,60 @@
 #include "sleeplock.h"
 #include "file.h"
 
-#define PIPESIZE 512
+// A pipe's data is a ring of 2^order pages, one by default;
+// fcntl(F_SETPIPE_SZ) resizes it, up to 2^PIPEMAXORDER pages.
+// The pages are allocated as they are first written. Reads and
+// writes copy contiguous runs of the ring, up to the end of a
+// page.
+//
+// Whole pages are flipped rather than copied: a write of a
+// page-aligned user page, at a page boundary of the ring, puts
+// that physical page in the ring, shared copy-on-write with the
+// writer; a read of a whole ring page into a page-aligned user
+// page maps the ring page there and takes the reader's old page
+// for the ring. Smaller or unaligned transfers are copied.
+//
+// Readers and writers that must wait say how much they want,
+// capped at half the ring or a page, whichever is more (so that
+// whole pages can be flipped), and are woken only once that much
+// is there (or when the other side finishes, closes or waits
+// itself), so that a fast writer and a slow reader do not wake
+// each other for every few bytes.
+#define PIPEMAXORDER 4
 
 struct pipe {
   struct spinlock lock;
-  char data[PIPESIZE];
+  char *page[1<<PIPEMAXORDER];  // the ring; 0 if not yet needed
+  uint size;      // PGSIZE << order bytes
+  int order;
   uint nread;     // number of bytes read
   uint nwrite;    // number of bytes written
   int readopen;   // read fd is still open
   int writeopen;  // write fd is still open
+  int rbusy;      // a splice is reading in place
+  char *rpage;    // ... from this page, which it holds a reference to
+  int wbusy;      // a splice is writing in place
+  int rwait;      // readers sleeping
+  int wwait;      // writers sleeping
+  uint rwant;     // least data a sleeping reader waits for
+  uint wwant;     // least space a sleeping writer waits for
 };
 
+static struct kmem_cache *pipecache;
+
+// runs once per pipe object, when its slab is created.
+static void
+pipector(void *p)
+{
+  initlock(&((struct pipe*)p)->lock, "pipe");
+}
+
+void
+pipeinit(void)
+{
+  pipecache = kmem_cache_create("pipe", sizeof(struct pipe), pipector);
+}
+
 int
 pipealloc(struct file **f0, struct file **f1)
 {
@@ -28,13 +71,21 @@ pipealloc(struct file **f0, struct file **f1)
   *f0 = *f1 = 0;
   if((*f0 = filealloc()) == 0 || (*f1 = filealloc()) == 0)
     goto bad;
-  if((pi = (struct pipe*)kalloc()) == 0)
+  if((pi = kmem_cache_alloc(pipecache)) == 0)
     goto bad;
+  memset(pi->page, 0, sizeof(pi->page));
+  pi->order = 0;
+  pi->size = PGSIZE;
   pi->readopen = 1;
   pi->writeopen = 1;
   pi->nwrite = 0;
   pi->nread = 0;
-  initlock(&pi->lock, "pipe");
+  pi->rbusy = 0;
+  pi->wbusy = 0;
+  pi->rwait = 0;
+  pi->wwait = 0;
+  pi->rwant = ~0U;
+  pi->wwant = ~0U;
   (*f0)->type = FD_PIPE;
   (*f0)->readable = 1;
   (*f0)->writable = 0;
@@ -47,7 +98,7 @@ pipealloc(struct file **f0, struct file **f1)
 
  bad:
   if(pi)
-    kfree((char*)pi);
+    kmem_cache_free(pipecache, pi);
   if(*f0)
     fileclose(*f0);
   if(*f1)
@@ -55,6 +106,16 @@ pipealloc(struct file **f0, struct file **f1)
   return -1;
 }
 
+static void
+pipe_freepages(char **page, int n)
+{
+  int i;
+
+  for(i = 0; i < n; i++)
+    if(page[i])
+      kfree(page[i]);
+}
+
 void
 pipeclose(struct pipe *pi, int writable)
 {
@@ -68,35 +129,206 @@ pipeclose(struct pipe *pi, int writable)
   }
   if(pi->readopen == 0 && pi->writeopen == 0){
     release(&pi->lock);
-    kfree((char*)pi);
+    pipe_freepages(pi->page, 1 << pi->order);
+    kmem_cache_free(pipecache, pi);
   } else
     release(&pi->lock);
 }
 
+#define WANTMAX(pi) ((pi)->size/2 > PGSIZE ? (pi)->size/2 : PGSIZE)
+
+// Sleep until woken by pipe_wwake(), wanting want bytes of space.
+// wwant is the least any sleeping writer wants.
+// Caller holds pi->lock.
+static void
+pipe_wsleep(struct pipe *pi, uint want)
+{
+  if(want > WANTMAX(pi))
+    want = WANTMAX(pi);
+  if(want < pi->wwant)
+    pi->wwant = want;
+  pi->wwait++;
+  sleep(&pi->nwrite, &pi->lock);
+  if(--pi->wwait == 0)
+    pi->wwant = ~0U;
+}
+
+// Wake the longest sleeping writer if there is the space a
+// writer wants. Only one writer at a time can use the space,
+// so one that leaves some calls this again to pass it on.
+// Caller holds pi->lock.
+static void
+pipe_wwake(struct pipe *pi)
+{
+  if(pi->wwait && pi->size - (pi->nwrite - pi->nread) >= pi->wwant)
+    wakeone(&pi->nwrite);
+}
+
+// Sleep until woken by pipe_rwake(), wanting want bytes of data.
+// rwant is the least any sleeping reader wants.
+// Caller holds pi->lock.
+static void
+pipe_rsleep(struct pipe *pi, uint want)
+{
+  if(want > WANTMAX(pi))
+    want = WANTMAX(pi);
+  if(want < pi->rwant)
+    pi->rwant = want;
+  pi->rwait++;
+  sleep(&pi->nread, &pi->lock);
+  if(--pi->rwait == 0)
+    pi->rwant = ~0U;
+}
+
+// Wake the longest sleeping reader if there is the data a
+// reader wants, or if all, any data. As with writers, a
+// reader that leaves data calls this again to pass it on.
+// Caller holds pi->lock.
+static void
+pipe_rwake(struct pipe *pi, int all)
+{
+  uint n = pi->nwrite - pi->nread;
+
+  if(pi->rwait && n > 0 && (all || n >= pi->rwant))
+    wakeone(&pi->nread);
+}
+
+// Ring page holding stream position pos.
+#define PAGE(pi, pos) ((pi)->page[(pos) % (pi)->size / PGSIZE])
+
+// Bytes from position pos to the end of its ring page.
+#define PAGELEFT(pos) (PGSIZE - (pos) % PGSIZE)
+
+// Return the address of position pos in the ring, allocating
+// its page if need be and making it the pipe's own if it is
+// shared with a user page table. Returns 0 if out of memory.
+// Caller holds pi->lock.
+static char*
+pipe_wpage(struct pipe *pi, uint pos)
+{
+  char **pp = &PAGE(pi, pos);
+  char *mem;
+
+  if(*pp == 0){
+    if((*pp = kalloc()) == 0)
+      return 0;
+  } else if(kshared(*pp)){
+    // the rest of the page may hold unread data.
+    if((mem = kalloc()) == 0)
+      return 0;
+    memmove(mem, *pp, PGSIZE);
+    kfree(*pp);
+    *pp = mem;
+  }
+  return *pp + pos % PGSIZE;
+}
+
+// Append the user page at va to the ring without copying, if
+// it is a whole page at a page boundary of the ring and the
+// ring page there is free. The writer keeps the page,
+// copy-on-write. Returns 1 if done.
+// Caller holds pi->lock.
+static int
+pipe_flipin(struct pipe *pi, pagetable_t pagetable, uint64 va, uint n)
+{
+  char **pp = &PAGE(pi, pi->nwrite);
+  pte_t *pte;
+  uint64 pa;
+
+  if(va % PGSIZE != 0 || n < PGSIZE || va >= MAXVA ||
+     pi->nwrite % PGSIZE != 0 ||
+     pi->size - (pi->nwrite - pi->nread) < PGSIZE)
+    return 0;
+  pte = walk(pagetable, va, 0);
+  if(pte == 0 || (*pte & (PTE_V|PTE_U|PTE_R)) != (PTE_V|PTE_U|PTE_R))
+    return 0;
+  pa = PTE2PA(*pte);
+  if(*pte & PTE_W){
+    *pte = (*pte & ~PTE_W) | PTE_COW;
+    sfence_vma();
+  }
+  kdup((void*)pa);
+  if(*pp)
+    kfree(*pp);
+  *pp = (char*)pa;
+  pi->nwrite += PGSIZE;
+  return 1;
+}
+
+// Move the ring page at the read position to the user page at
+// va without copying, if it is a whole page of unread data and
+// va a writable, page-aligned user page, which the ring takes
+// in exchange. Returns 1 if done.
+// Caller holds pi->lock.
+static int
+pipe_flipout(struct pipe *pi, pagetable_t pagetable, uint64 va, uint n)
+{
+  char **pp = &PAGE(pi, pi->nread);
+  pte_t *pte;
+  uint64 pa, flags;
+
+  if(va % PGSIZE != 0 || n < PGSIZE || va >= MAXVA ||
+     pi->nread % PGSIZE != 0 || pi->nwrite - pi->nread < PGSIZE)
+    return 0;
+  pte = walk(pagetable, va, 0);
+  if(pte == 0 || (*pte & (PTE_V|PTE_U|PTE_R)) != (PTE_V|PTE_U|PTE_R) ||
+     (*pte & (PTE_W|PTE_COW)) == 0)
+    return 0;
+  pa = PTE2PA(*pte);
+  flags = PTE_FLAGS(*pte) & ~(PTE_W|PTE_COW);
+  // a page the writer still has stays copy-on-write.
+  flags |= kshared(*pp) ? PTE_COW : PTE_W;
+  *pte = PA2PTE(*pp) | flags;
+  sfence_vma();
+  if(kshared((void*)pa)){
+    kfree((void*)pa);
+    *pp = 0;
+  } else {
+    *pp = (char*)pa;
+  }
+  pi->nread += PGSIZE;
+  return 1;
+}
+
 int
 pipewrite(struct pipe *pi, uint64 addr, int n)
 {
   int i = 0;
+  uint m;
+  char *dst;
   struct proc *pr = myproc();
 
   acquire(&pi->lock);
   while(i < n){
     if(pi->readopen == 0 || killed(pr)){
+      pipe_wwake(pi);
       release(&pi->lock);
       return -1;
     }
-    if(pi->nwrite == pi->nread + PIPESIZE){ //DOC: pipewrite-full
-      wakeup(&pi->nread);
-      sleep(&pi->nwrite, &pi->lock);
+    if(pi->wbusy || pi->nwrite == pi->nread + pi->size){ //DOC: pipewrite-full
+      pipe_rwake(pi, 1);
+      pipe_wsleep(pi, n - i);
+      continue;
+    }
+    if(pipe_flipin(pi, pr->pagetable, addr + i, n - i)){
+      m = PGSIZE;
     } else {
-      char ch;
-      if(copyin(pr->pagetable, &ch, addr + i, 1) == -1)
+      // copy as much as fits before the end of the ring page.
+      m = pi->size - (pi->nwrite - pi->nread);
+      if(m > PAGELEFT(pi->nwrite))
+        m = PAGELEFT(pi->nwrite);
+      if(m > n - i)
+        m = n - i;
+      if((dst = pipe_wpage(pi, pi->nwrite)) == 0 ||
+         copyin(pr->pagetable, dst, addr + i, m) == -1)
         break;
-      pi->data[pi->nwrite++ % PIPESIZE] = ch;
-      i++;
+      pi->nwrite += m;
     }
+    i += m;
+    pipe_rwake(pi, 0);
   }
-  wakeup(&pi->nread);
+  pipe_rwake(pi, 1);
+  pipe_wwake(pi);  // other writers
   release(&pi->lock);
 
   return i;
@@ -106,25 +338,211 @@ int
 piperead(struct pipe *pi, uint64 addr, int n)
 {
   int i;
+  uint m;
   struct proc *pr = myproc();
-  char ch;
 
   acquire(&pi->lock);
-  while(pi->nread == pi->nwrite && pi->writeopen){  //DOC: pipe-empty
+  while(pi->rbusy || (pi->nread == pi->nwrite && pi->writeopen)){  //DOC: pipe-empty
     if(killed(pr)){
+      pipe_rwake(pi, 1);
       release(&pi->lock);
       return -1;
     }
-    sleep(&pi->nread, &pi->lock); //DOC: piperead-sleep
+    pipe_rsleep(pi, n); //DOC: piperead-sleep
   }
-  for(i = 0; i < n; i++){  //DOC: piperead-copy
-    if(pi->nread == pi->nwrite)
-      break;
-    ch = pi->data[pi->nread++ % PIPESIZE];
-    if(copyout(pr->pagetable, addr + i, &ch, 1) == -1)
+  for(i = 0; i < n && pi->nread != pi->nwrite; i += m){  //DOC: piperead-copy
+    if(pipe_flipout(pi, pr->pagetable, addr + i, n - i)){
+      m = PGSIZE;
+      continue;
+    }
+    m = pi->nwrite - pi->nread;
+    if(m > PAGELEFT(pi->nread))
+      m = PAGELEFT(pi->nread);
+    if(m > n - i)
+      m = n - i;
+    if(copyout(pr->pagetable, addr + i,
+               PAGE(pi, pi->nread) + pi->nread % PGSIZE, m) == -1)
       break;
+    pi->nread += m;
   }
-  wakeup(&pi->nwrite);  //DOC: piperead-wakeup
+  pipe_wwake(pi);  //DOC: piperead-wakeup
+  pipe_rwake(pi, 1);  // other readers
   release(&pi->lock);
   return i;
 }
+
+// The size of the pipe's ring, in bytes.
+int
+pipegetsize(struct pipe *pi)
+{
+  return pi->size;
+}
+
+// Make the pipe's ring at least n bytes, rounded up to a power
+// of two pages, keeping the data in it. Fails if that is too
+// big, or too small for the data, or a splice is using the ring.
+// Returns the new size.
+int
+pipesetsize(struct pipe *pi, int n)
+{
+  char *page[1<<PIPEMAXORDER], *old[1<<PIPEMAXORDER];
+  uint len, k, pos;
+  int order, oldorder, i;
+
+  if(n <= 0)
+    return -1;
+  for(order = 0; order <= PIPEMAXORDER && (PGSIZE << order) < n; order++)
+    ;
+  if(order > PIPEMAXORDER)
+    return -1;
+
+  acquire(&pi->lock);
+  len = pi->nwrite - pi->nread;
+  if(pi->rbusy || pi->wbusy || len > (PGSIZE << order)){
+    release(&pi->lock);
+    return -1;
+  }
+  // copy the data to the start of the new ring, allocating just
+  // the pages it needs; pipe_wpage() fills in the rest.
+  memset(page, 0, sizeof(page));
+  for(i = 0; i < (len + PGSIZE - 1) / PGSIZE; i++){
+    if((page[i] = kalloc()) == 0){
+      release(&pi->lock);
+      pipe_freepages(page, i);
+      return -1;
+    }
+  }
+  for(pos = 0; pos < len; pos += k){
+    k = PAGELEFT(pi->nread + pos);
+    if(k > PAGELEFT(pos))
+      k = PAGELEFT(pos);
+    if(k > len - pos)
+      k = len - pos;
+    memmove(page[pos / PGSIZE] + pos % PGSIZE,
+            PAGE(pi, pi->nread + pos) + (pi->nread + pos) % PGSIZE, k);
+  }
+  oldorder = pi->order;
+  memmove(old, pi->page, sizeof(old));
+  memmove(pi->page, page, sizeof(page));
+  pi->order = order;
+  pi->size = PGSIZE << order;
+  pi->nread = 0;
+  pi->nwrite = len;
+  // let sleepers re-check against the new size.
+  pi->rwant = pi->wwant = ~0U;
+  wakeup(&pi->nread);
+  wakeup(&pi->nwrite);
+  n = pi->size;
+  release(&pi->lock);
+
+  pipe_freepages(old, 1 << oldorder);
+  return n;
+}
+
+// In-place access to the pipe's buffer, for splice: the data is
+// copied straight between the buffer and a file, once, without
+// holding pi->lock. One splice at a time may read, and one may
+// write; other readers or writers wait for it to finish.
+
+// Claim the free space at the head of the buffer, waiting for
+// some. Sets *p to it and returns its length, at most n, or -1
+// if the pipe has no reader or memory. Call pipe_wend() when done.
+int
+pipe_wbegin(struct pipe *pi, char **p, int n)
+{
+  struct proc *pr = myproc();
+  uint m;
+
+  acquire(&pi->lock);
+  for(;;){
+    if(pi->readopen == 0 || killed(pr)){
+      pipe_wwake(pi);
+      release(&pi->lock);
+      return -1;
+    }
+    if(!pi->wbusy && pi->nwrite != pi->nread + pi->size)
+      break;
+    pipe_rwake(pi, 1);
+    pipe_wsleep(pi, n);
+  }
+  if((*p = pipe_wpage(pi, pi->nwrite)) == 0){
+    release(&pi->lock);
+    return -1;
+  }
+  m = pi->size - (pi->nwrite - pi->nread);
+  if(m > PAGELEFT(pi->nwrite))
+    m = PAGELEFT(pi->nwrite);  // up to the end of the page
+  if(m > n)
+    m = n;
+  pi->wbusy = 1;
+  release(&pi->lock);
+  return m;
+}
+
+// Finish pipe_wbegin(), having written n bytes.
+void
+pipe_wend(struct pipe *pi, int n)
+{
+  acquire(&pi->lock);
+  pi->nwrite += n;
+  pi->wbusy = 0;
+  pipe_rwake(pi, 1);
+  wakeup(&pi->nwrite);  // other writers
+  release(&pi->lock);
+}
+
+// Claim the data at the tail of the buffer, waiting for some
+// if wait is set. Sets *p to it and returns its length, at
+// most n; 0 if there is none and no writer (or wait is not
+// set), -1 if killed. Call pipe_rend() after a positive return.
+int
+pipe_rbegin(struct pipe *pi, char **p, int n, int wait)
+{
+  struct proc *pr = myproc();
+  uint m;
+
+  acquire(&pi->lock);
+  for(;;){
+    if(killed(pr)){
+      pipe_rwake(pi, 1);
+      release(&pi->lock);
+      return -1;
+    }
+    if(!pi->rbusy && pi->nread != pi->nwrite)
+      break;
+    if(!pi->rbusy && (!pi->writeopen || !wait)){
+      release(&pi->lock);
+      return 0;
+    }
+    pipe_rsleep(pi, n);
+  }
+  m = pi->nwrite - pi->nread;
+  if(m > PAGELEFT(pi->nread))
+    m = PAGELEFT(pi->nread);
+  if(m > n)
+    m = n;
+  pi->rbusy = 1;
+  // a writer may replace the page (see pipe_wpage()), but not
+  // free it, meanwhile.
+  pi->rpage = PAGE(pi, pi->nread);
+  kdup(pi->rpage);
+  *p = pi->rpage + pi->nread % PGSIZE;
+  release(&pi->lock);
+  return m;
+}
+
+// Finish pipe_rbegin(), having consumed n bytes.
+void
+pipe_rend(struct pipe *pi, int n)
+{
+  char *pg;
+
+  acquire(&pi->lock);
+  pi->nread += n;
+  pi->rbusy = 0;
+  pg = pi->rpage;
+  pipe_wwake(pi);
+  wakeup(&pi->nread);  // other readers
+  release(&pi->lock);
+  kfree(pg);
+}
@@ -17,9 +17,46 @@ struct spinlock pid_lock;
 
 extern void forkret(void);
 static void freeproc(struct proc *p);
+static void ready(struct proc *p);
 
 extern char trampoline[]; // trampoline.S
 
+// Wait queues. A process sleeping on a channel is on the queue
+// the channel hashes to, oldest first, so wakeup() looks only at
+// the processes that might be sleeping on it. A queue's lock is
+// taken before any p->lock.
+#define NWAITQ 61
+#define WAITQ(chan) (&waitq[((uint64)(chan) >> 3) % NWAITQ])
+
+struct waitq {
+  struct spinlock lock;
+  struct proc *head;
+} waitq[NWAITQ];
+
+// Times an idle cpu looks for work before it stops in wfi
+// until the next interrupt.
+#define IDLESPIN 1000
+
+// Run time, in r_time() units (10 MHz in qemu), by which a waking
+// fair process may be ahead of those already queued, so a process
+// that mostly sleeps runs promptly without being able to bank
+// unbounded credit.
+#define SLEEPCREDIT 500000
+#define VRTMS 10000  // r_time() units per millisecond
+
+// Fair class weight of each nice value, -20 .. 19; each step is
+// worth about 10% of the cpu relative to the one next to it.
+static const int niceweight[40] = {
+  /* -20 */ 88761, 71755, 56483, 46273, 36291,
+  /* -15 */ 29154, 23254, 18705, 14949, 11916,
+  /* -10 */ 9548, 7620, 6100, 4904, 3906,
+  /*  -5 */ 3121, 2501, 1991, 1586, 1277,
+  /*   0 */ 1024, 820, 655, 526, 423,
+  /*   5 */ 335, 272, 215, 172, 137,
+  /*  10 */ 110, 87, 70, 56, 45,
+  /*  15 */ 36, 29, 23, 18, 15,
+};
+
 // helps ensure that wakeups of wait()ing
 // parents are not lost. helps obey the
 // memory model when using p->parent.
@@ -48,9 +85,15 @@ void
 procinit(void)
 {
   struct proc *p;
+  struct cpu *c;
+  struct waitq *wq;
   
   initlock(&pid_lock, "nextpid");
   initlock(&wait_lock, "wait_lock");
+  for(c = cpus; c < &cpus[NCPU]; c++)
+    initlock(&c->rqlock, "runq");
+  for(wq = waitq; wq < &waitq[NWAITQ]; wq++)
+    initlock(&wq->lock, "waitq");
   for(p = proc; p < &proc[NPROC]; p++) {
       initlock(&p->lock, "proc");
       p->state = UNUSED;
@@ -124,6 +167,11 @@ allocproc(void)
 found:
   p->pid = allocpid();
   p->state = USED;
+  p->cpu = cpuid();
+  p->class = SCHED_FAIR;
+  p->nice = 0;
+  p->prio = 0;
+  p->vruntime = 0;
 
   // Allocate a trapframe page.
   if((p->trapframe = (struct trapframe *)kalloc()) == 0){
@@ -249,9 +297,43 @@ userinit(void)
   safestrcpy(p->name, "initcode", sizeof(p->name));
   p->cwd = namei("/");
 
-  p->state = RUNNABLE;
+  ready(p);
+
+  release(&p->lock);
+}
+
+// A kernel thread's very first scheduling by scheduler()
+// will swtch to kthreadret.
+static void
+kthreadret(void)
+{
+  struct proc *p = myproc();
 
+  // Still holding p->lock from scheduler.
   release(&p->lock);
+
+  p->kfn();
+  panic("kthread returned");
+}
+
+// Start a kernel thread: a process with no user memory that
+// runs fn() in the kernel, which must never return.
+// Returns its pid, or -1 if there are no free procs.
+int
+kthread(void (*fn)(void), char *name)
+{
+  struct proc *p;
+  int pid;
+
+  if((p = allocproc()) == 0)
+    return -1;
+  p->kfn = fn;
+  p->context.ra = (uint64)kthreadret;
+  safestrcpy(p->name, name, sizeof(p->name));
+  pid = p->pid;
+  ready(p);
+  release(&p->lock);
+  return pid;
 }
 
 // Grow or shrink user memory by n bytes.
@@ -310,6 +392,11 @@ fork(void)
 
   safestrcpy(np->name, p->name, sizeof(p->name));
 
+  np->class = p->class;
+  np->nice = p->nice;
+  np->prio = p->prio;
+  np->vruntime = p->vruntime;
+
   pid = np->pid;
 
   release(&np->lock);
@@ -319,7 +406,7 @@ fork(void)
   release(&wait_lock);
 
   acquire(&np->lock);
-  np->state = RUNNABLE;
+  ready(np);
   release(&np->lock);
 
   return pid;
@@ -434,18 +521,157 @@ wait(uint64 addr)
   }
 }
 
+// Wake cpu c from wfi with a machine software interrupt,
+// which timervec passes on as a supervisor one.
+static void
+kick(struct cpu *c)
+{
+  *(volatile uint32 *)CLINT_MSIP(c - cpus) = 1;
+}
+
+// Should a run before b?
+static int
+before(struct proc *a, struct proc *b)
+{
+  if(a->class != b->class)
+    return a->class == SCHED_PRIO;
+  if(a->class == SCHED_PRIO)
+    return a->prio > b->prio;
+  return a->vruntime < b->vruntime;
+}
+
+// Make p RUNNABLE and put it on the run queue of the cpu it
+// last ran on, behind every process that should run before it
+// and those equal to it. Caller must hold p->lock.
+static void
+ready(struct proc *p)
+{
+  struct cpu *c = &cpus[p->cpu];
+  struct proc **pp;
+
+  p->state = RUNNABLE;
+  acquire(&c->rqlock);
+  if(p->class == SCHED_FAIR && p->vruntime + SLEEPCREDIT < c->minvruntime)
+    p->vruntime = c->minvruntime - SLEEPCREDIT;
+  for(pp = &c->rqhead; *pp && !before(p, *pp); pp = &(*pp)->rqnext)
+    ;
+  p->rqnext = *pp;
+  *pp = p;
+  c->nrun++;
+  release(&c->rqlock);
+
+  // c may have checked its queue just before we added p.
+  __sync_synchronize();
+  if(c != mycpu() && c->idle)
+    kick(c);
+}
+
+// Take the process at the head of c's run queue, or 0.
+static struct proc*
+dequeue(struct cpu *c)
+{
+  struct proc *p;
+
+  acquire(&c->rqlock);
+  if((p = c->rqhead) != 0){
+    c->rqhead = p->rqnext;
+    c->nrun--;
+    if(p->class == SCHED_FAIR && p->vruntime > c->minvruntime)
+      c->minvruntime = p->vruntime;
+  }
+  release(&c->rqlock);
+  return p;
+}
+
+// Take p off c's run queue, if it is there.
+// Returns 1 if it was. Caller must hold p->lock.
+static int
+unqueue(struct cpu *c, struct proc *p)
+{
+  struct proc **pp;
+  int found = 0;
+
+  acquire(&c->rqlock);
+  for(pp = &c->rqhead; *pp; pp = &(*pp)->rqnext){
+    if(*pp == p){
+      *pp = p->rqnext;
+      c->nrun--;
+      found = 1;
+      break;
+    }
+  }
+  release(&c->rqlock);
+  return found;
+}
+
+// This cpu's run queue is empty: take a process from
+// the longest other one, or return 0 if all are empty.
+static struct proc*
+steal(struct cpu *c)
+{
+  struct cpu *v, *busiest;
+  struct proc *p;
+  int n, most;
+
+  for(;;){
+    busiest = 0;
+    most = 0;
+    for(v = cpus; v < &cpus[NCPU]; v++){
+      n = *(volatile int *)&v->nrun;
+      if(v != c && n > most){
+        busiest = v;
+        most = n;
+      }
+    }
+    if(busiest == 0)
+      return 0;
+    // Someone else may have emptied it meanwhile.
+    if((p = dequeue(busiest)) != 0){
+      // Carry its vruntime over relative to the queues'
+      // minimums; off every queue, p is ours to change.
+      if(p->class == SCHED_FAIR){
+        if(p->vruntime + c->minvruntime > busiest->minvruntime)
+          p->vruntime = p->vruntime + c->minvruntime - busiest->minvruntime;
+        else
+          p->vruntime = 0;
+      }
+      return p;
+    }
+  }
+}
+
+// Is there a RUNNABLE process on any run queue?
+static int
+anyrunnable(void)
+{
+  struct cpu *v;
+
+  for(v = cpus; v < &cpus[NCPU]; v++)
+    if(*(volatile int *)&v->nrun > 0)
+      return 1;
+  return 0;
+}
+
 // Per-CPU process scheduler.
 // Each CPU calls scheduler() after setting itself up.
 // Scheduler never returns.  It loops, doing:
-//  - choose a process to run.
+//  - choose a process to run: the head of this CPU's
+//    run queue, or one stolen from the busiest other.
 //  - swtch to start running that process.
 //  - eventually that process transfers control
 //    via swtch back to the scheduler.
+//  - charge it for the time it ran and, if it only
+//    yielded, queue it again.
+// With nothing to run the CPU waits in wfi, so it
+// notices new work at its next interrupt.
 void
 scheduler(void)
 {
   struct proc *p;
   struct cpu *c = mycpu();
+  int cid = c - cpus;
+  int spin = 0;
+  uint64 start;
 
   c->proc = 0;
   for(;;){
@@ -454,22 +680,47 @@ scheduler(void)
     // processes are waiting.
     intr_on();
 
-    for(p = proc; p < &proc[NPROC]; p++) {
-      acquire(&p->lock);
-      if(p->state == RUNNABLE) {
-        // Switch to chosen process.  It is the process's job
-        // to release its lock and then reacquire it
-        // before jumping back to us.
-        p->state = RUNNING;
-        c->proc = p;
-        swtch(&c->context, &p->context);
-
-        // Process is done running for now.
-        // It should have changed its p->state before coming back.
-        c->proc = 0;
-      }
-      release(&p->lock);
+    if((p = dequeue(c)) == 0 && (p = steal(c)) == 0){
+      if(++spin < IDLESPIN)
+        continue;
+      // Check again with interrupts off, having said we
+      // are idle: one making a process RUNNABLE after the
+      // check sees that and kick()s us, which leaves an
+      // interrupt pending, and a pending interrupt ends
+      // the wfi (or keeps it from starting).
+      intr_off();
+      c->idle = 1;
+      __sync_synchronize();
+      if(!anyrunnable())
+        wfi();
+      c->idle = 0;
+      spin = 0;
+      continue;
+    }
+    spin = 0;
+
+    // Off every run queue, p is ours: nothing changes
+    // the state of a RUNNABLE process but its scheduler.
+    acquire(&p->lock);
+    if(p->state == RUNNABLE) {
+      // Switch to chosen process.  It is the process's job
+      // to release its lock and then reacquire it
+      // before jumping back to us.
+      p->state = RUNNING;
+      p->cpu = cid;
+      c->proc = p;
+      start = r_time();
+      swtch(&c->context, &p->context);
+
+      // Process is done running for now.
+      // It should have changed its p->state before coming back.
+      c->proc = 0;
+      if(p->class == SCHED_FAIR)
+        p->vruntime += (r_time() - start) * niceweight[20] / niceweight[p->nice + 20];
+      if(p->state == RUNNABLE)
+        ready(p);
     }
+    release(&p->lock);
   }
 }
 
@@ -501,6 +752,8 @@ sched(void)
 }
 
 // Give up the CPU for one scheduling round.
+// The scheduler queues p again once it has
+// been charged for the time it ran.
 void
 yield(void)
 {
@@ -541,47 +794,96 @@ void
 sleep(void *chan, struct spinlock *lk)
 {
   struct proc *p = myproc();
+  struct waitq *wq = WAITQ(chan);
+  struct proc **pp;
   
   // Must acquire p->lock in order to
-  // change p->state and then call sched.
-  // Once we hold p->lock, we can be
+  // change p->state and then call sched,
+  // and wq->lock to join the wait queue.
+  // Once we hold wq->lock, we can be
   // guaranteed that we won't miss any wakeup
-  // (wakeup locks p->lock),
+  // (wakeup locks wq->lock),
   // so it's okay to release lk.
 
+  acquire(&wq->lock);
   acquire(&p->lock);  //DOC: sleeplock1
   release(lk);
 
-  // Go to sleep.
+  // Go to sleep, at the tail of the queue.
   p->chan = chan;
+  p->wqnext = 0;
+  for(pp = &wq->head; *pp; pp = &(*pp)->wqnext)
+    ;
+  *pp = p;
   p->state = SLEEPING;
+  release(&wq->lock);
 
   sched();
 
-  // Tidy up.
-  p->chan = 0;
+  release(&p->lock);
+
+  // Tidy up. wakeup() takes p off the queue, but
+  // kill() leaves that to p.
+  if(p->chan){
+    acquire(&wq->lock);
+    for(pp = &wq->head; *pp != p; pp = &(*pp)->wqnext)
+      ;
+    *pp = p->wqnext;
+    p->chan = 0;
+    release(&wq->lock);
+  }
 
   // Reacquire original lock.
-  release(&p->lock);
   acquire(lk);
 }
 
-// Wake up all processes sleeping on chan.
-// Must be called without any p->lock.
-void
-wakeup(void *chan)
+// Wake processes sleeping on chan, oldest first:
+// all of them, or only the first if one is set.
+static void
+wake(void *chan, int one)
 {
-  struct proc *p;
+  struct waitq *wq = WAITQ(chan);
+  struct proc **pp, *p;
 
-  for(p = proc; p < &proc[NPROC]; p++) {
-    if(p != myproc()){
+  acquire(&wq->lock);
+  pp = &wq->head;
+  while((p = *pp) != 0){
+    if(p->chan == chan){
       acquire(&p->lock);
-      if(p->state == SLEEPING && p->chan == chan) {
-        p->state = RUNNABLE;
+      // not SLEEPING if kill() woke it; it is on
+      // its way to take itself off the queue.
+      if(p->state == SLEEPING){
+        *pp = p->wqnext;
+        p->chan = 0;
+        ready(p);
+        release(&p->lock);
+        if(one)
+          break;
+        continue;
       }
       release(&p->lock);
     }
+    pp = &p->wqnext;
   }
+  release(&wq->lock);
+}
+
+// Wake up all processes sleeping on chan.
+// Must be called without any p->lock.
+void
+wakeup(void *chan)
+{
+  wake(chan, 0);
+}
+
+// Wake up the process that has slept longest on chan, for
+// when only one of them can make progress; it must pass
+// the wakeup on if it leaves something for the others.
+// Must be called without any p->lock.
+void
+wakeone(void *chan)
+{
+  wake(chan, 1);
 }
 
 // Kill the process with the given pid.
@@ -598,7 +900,7 @@ kill(int pid)
       p->killed = 1;
       if(p->state == SLEEPING){
         // Wake process from sleep().
-        p->state = RUNNABLE;
+        ready(p);
       }
       release(&p->lock);
       return 0;
@@ -608,6 +910,55 @@ kill(int pid)
   return -1;
 }
 
+// Add inc to the caller's nice value, which weights its
+// share of the cpu in the fair class. Returns the new value.
+int
+nice(int inc)
+{
+  struct proc *p = myproc();
+  int n;
+
+  acquire(&p->lock);
+  n = p->nice + inc;
+  if(n < -20)
+    n = -20;
+  if(n > 19)
+    n = 19;
+  p->nice = n;
+  release(&p->lock);
+  return n;
+}
+
+// Put process pid (0 for the caller) in the priority class
+// with priority prio, or back in the fair class if prio is 0.
+int
+setpriority(int pid, int prio)
+{
+  struct proc *p;
+  int queued;
+
+  if(prio < 0 || prio > NPRIO)
+    return -1;
+  if(pid == 0)
+    pid = myproc()->pid;
+  for(p = proc; p < &proc[NPROC]; p++){
+    acquire(&p->lock);
+    if(p->pid == pid && p->state != UNUSED && p->state != ZOMBIE){
+      // A queued process must be requeued in its new place;
+      // one a scheduler has just dequeued is about to run.
+      queued = p->state == RUNNABLE && unqueue(&cpus[p->cpu], p);
+      p->class = prio ? SCHED_PRIO : SCHED_FAIR;
+      p->prio = prio;
+      if(queued)
+        ready(p);
+      release(&p->lock);
+      return 0;
+    }
+    release(&p->lock);
+  }
+  return -1;
+}
+
 void
 setkilled(struct proc *p)
 {
@@ -674,7 +1025,7 @@ procdump(void)
   struct proc *p;
   char *state;
 
-  printf("\n");
+  printf("\npid state  cpu class vruntime(ms) name\n");
   for(p = proc; p < &proc[NPROC]; p++){
     if(p->state == UNUSED)
       continue;
@@ -682,7 +1033,12 @@ procdump(void)
       state = states[p->state];
     else
       state = "???";
-    printf("%d %s %s", p->pid, state, p->name);
+    printf("%d %s %d ", p->pid, state, p->cpu);
+    if(p->class == SCHED_PRIO)
+      printf("prio%d - ", p->prio);
+    else
+      printf("nice%d %d ", p->nice, (int)(p->vruntime / VRTMS));
+    printf("%s", p->name);
     printf("\n");
   }
 }
@@ -24,6 +24,15 @@ struct cpu {
   struct context context;     // swtch() here to enter scheduler().
   int noff;                   // Depth of push_off() nesting.
   int intena;                 // Were interrupts enabled before push_off()?
+
+  // The run queue: RUNNABLE processes waiting for this cpu,
+  // in the order they should run, linked through p->rqnext.
+  // rqlock protects it; nrun may be read without it, as a hint.
+  struct spinlock rqlock;
+  struct proc *rqhead;
+  int nrun;
+  uint64 minvruntime;         // Fair processes queued here start no lower
+  int idle;                   // Waiting in wfi; kick() it to queue work
 };
 
 extern struct cpu cpus[NCPU];
@@ -81,16 +90,36 @@ struct trapframe {
 
 enum procstate { UNUSED, USED, SLEEPING, RUNNABLE, RUNNING, ZOMBIE };
 
+// Scheduling classes. A RUNNABLE process of the priority class
+// always runs before any of the fair class; among themselves the
+// higher priority runs first, and equals take turns. The fair
+// class shares what is left in proportion to weights set by the
+// processes' nice values: the one that has run least, its run
+// time divided by its weight (its vruntime), runs next.
+enum schedclass { SCHED_FAIR, SCHED_PRIO };
+#define NPRIO 32  // priority class priorities are 1..NPRIO
+
 // Per-process state
 struct proc {
   struct spinlock lock;
 
   // p->lock must be held when using these:
   enum procstate state;        // Process state
-  void *chan;                  // If non-zero, sleeping on chan
+  void *chan;                  // If non-zero, on chan's wait queue
   int killed;                  // If non-zero, have been killed
   int xstate;                  // Exit status to be returned to parent's wait
   int pid;                     // Process ID
+  int cpu;                     // Cpu whose run queue it goes on
+  enum schedclass class;       // Scheduling class
+  int nice;                    // Fair class: -20 (most cpu) .. 19 (least)
+  int prio;                    // Priority class: 1 .. NPRIO
+  uint64 vruntime;             // Fair class: weighted time run, in r_time() units
+
+  // the run queue's rqlock must be held when using this:
+  struct proc *rqnext;         // Next on the run queue
+
+  // the wait queue's lock must be held when using this:
+  struct proc *wqnext;         // Next on the wait queue
 
   // wait_lock must be held when using this:
   struct proc *parent;         // Parent process
@@ -104,4 +133,6 @@ struct proc {
   struct file *ofile[NOFILE];  // Open files
   struct inode *cwd;           // Current directory
   char name[16];               // Process name (debugging)
+  void (*kfn)(void);           // Body, if a kernel thread
+  int oplogged;                // log_write() since begin_op()
 };
@@ -0,0 +1,338 @@
+// Object caches for small, fixed-size kernel objects.
+//
+// A cache hands out objects of one size, packed into slabs:
+// single pages from kalloc() with a struct slab header at the
+// front and the objects behind it. Objects are run through the
+// cache's constructor once, when their slab is created, and
+// must be handed back to kmem_cache_free() in that constructed
+// state, so that hot objects are reused without re-initializing.
+//
+// Each CPU has a magazine of recently freed objects per cache.
+// kmem_cache_alloc() and kmem_cache_free() use only the current
+// CPU's magazine unless it is empty (alloc) or full (free); then
+// a batch moves between the magazine and the slabs under the
+// cache lock. A magazine's lock is only taken by other CPUs in
+// kmem_cache_reap(), so it is normally uncontended.
+//
+// kalloc_reclaim() calls kmem_cache_reap() when it runs out of
+// pages; slab code grows caches with plain kalloc(), which never
+// reclaims, so kmem_cache_alloc() may be called with spinlocks
+// held.
+//
+// Interface:
+// * c = kmem_cache_create(name, size, ctor) once at boot.
+// * p = kmem_cache_alloc(c), kmem_cache_free(c, p).
+// * kmem_cache_reap() returns cached memory to kalloc().
+// * kmem_cache_dump() prints per-cache usage and hit rates.
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "spinlock.h"
+#include "riscv.h"
+#include "defs.h"
+
+#define NCACHE   16              // maximum number of caches
+#define MAGSIZE  16              // objects per per-CPU magazine
+#define MAGBATCH (MAGSIZE/2)     // objects moved per refill/flush
+
+// the free-list link of an object lives just past its end,
+// so linking a free object does not disturb its constructed state.
+#define LINK(c, o) (*(void**)((char*)(o) + (c)->size))
+
+// lives at the start of each slab page.
+struct slab {
+  struct slab *next;       // on one of the cache's slab lists
+  struct slab *prev;
+  void *freelist;          // free objects in this slab
+  int inuse;               // objects handed out (incl. magazines)
+};
+
+struct kmem_cache {
+  struct spinlock lock;
+  char *name;
+  uint size;               // object size, rounded up
+  uint stride;             // size plus free-list link
+  int perslab;             // objects per slab
+  void (*ctor)(void*);
+
+  // protected by lock.
+  struct slab partial;     // some objects free
+  struct slab full;        // no objects free
+  struct slab empty;       // all objects free
+  int nslab;
+  int nempty;
+
+  // per-CPU magazines, indexed by cpuid().
+  struct {
+    struct spinlock lock;
+    void *obj[MAGSIZE];
+    int n;
+    uint64 allocs;         // kmem_cache_alloc() calls
+    uint64 hits;           // ... satisfied from the magazine
+  } mag[NCPU];
+};
+
+struct {
+  struct spinlock lock;
+  struct kmem_cache cache[NCACHE];
+  int n;
+} kmem_caches;
+
+static void
+slab_unlink(struct slab *s)
+{
+  s->next->prev = s->prev;
+  s->prev->next = s->next;
+}
+
+static void
+slab_push(struct slab *head, struct slab *s)
+{
+  s->next = head->next;
+  s->prev = head;
+  head->next->prev = s;
+  head->next = s;
+}
+
+static int
+slab_isempty(struct slab *head)
+{
+  return head->next == head;
+}
+
+// Create a cache of objects of the given size.
+// ctor (which may be 0) is run on every object once, when its
+// slab is created. Returns 0 if there are too many caches.
+struct kmem_cache*
+kmem_cache_create(char *name, uint size, void (*ctor)(void*))
+{
+  struct kmem_cache *c;
+
+  size = (size + 7) & ~7;
+  if(sizeof(struct slab) + size + sizeof(void*) > PGSIZE)
+    panic("kmem_cache_create: too big");
+
+  acquire(&kmem_caches.lock);
+  if(kmem_caches.n >= NCACHE){
+    release(&kmem_caches.lock);
+    return 0;
+  }
+  c = &kmem_caches.cache[kmem_caches.n++];
+  release(&kmem_caches.lock);
+
+  memset(c, 0, sizeof(*c));
+  initlock(&c->lock, name);
+  c->name = name;
+  c->size = size;
+  c->stride = size + sizeof(void*);
+  c->perslab = (PGSIZE - sizeof(struct slab)) / c->stride;
+  c->ctor = ctor;
+  c->partial.next = c->partial.prev = &c->partial;
+  c->full.next = c->full.prev = &c->full;
+  c->empty.next = c->empty.prev = &c->empty;
+  for(int i = 0; i < NCPU; i++)
+    initlock(&c->mag[i].lock, name);
+  return c;
+}
+
+// Add a fresh page s, whose objects have already been
+// constructed, to c as an empty slab. Called with c->lock held.
+static void
+slab_add(struct kmem_cache *c, struct slab *s)
+{
+  char *o;
+  int i;
+
+  s->freelist = 0;
+  s->inuse = 0;
+  for(i = c->perslab - 1; i >= 0; i--){
+    o = (char*)s + sizeof(struct slab) + i*c->stride;
+    LINK(c, o) = s->freelist;
+    s->freelist = o;
+  }
+  slab_push(&c->empty, s);
+  c->nslab++;
+  c->nempty++;
+}
+
+// Take one object out of the slabs.
+// Called with c->lock held; returns 0 if all slabs are full.
+static void*
+slab_get(struct kmem_cache *c)
+{
+  struct slab *s;
+  void *o;
+
+  if(!slab_isempty(&c->partial)){
+    s = c->partial.next;
+  } else if(!slab_isempty(&c->empty)){
+    s = c->empty.next;
+    c->nempty--;
+  } else {
+    return 0;
+  }
+
+  o = s->freelist;
+  s->freelist = LINK(c, o);
+  s->inuse++;
+  slab_unlink(s);
+  slab_push(s->inuse == c->perslab ? &c->full : &c->partial, s);
+  return o;
+}
+
+// Put an object back into its slab.
+// Called with c->lock held.
+static void
+slab_put(struct kmem_cache *c, void *p)
+{
+  struct slab *s = (struct slab*)PGROUNDDOWN((uint64)p);
+
+  LINK(c, p) = s->freelist;
+  s->freelist = p;
+  s->inuse--;
+  slab_unlink(s);
+  if(s->inuse > 0){
+    slab_push(&c->partial, s);
+  } else if(c->nempty > 0){
+    // keep one empty slab around; give the rest back.
+    c->nslab--;
+    kfree(s);
+  } else {
+    slab_push(&c->empty, s);
+    c->nempty++;
+  }
+}
+
+// Allocate an object from cache c.
+// Returns 0 if out of memory.
+void*
+kmem_cache_alloc(struct kmem_cache *c)
+{
+  struct slab *s;
+  void *p, *q;
+  int i, id;
+
+  push_off();
+  id = cpuid();
+  acquire(&c->mag[id].lock);
+  c->mag[id].allocs++;
+  if(c->mag[id].n > 0){
+    p = c->mag[id].obj[--c->mag[id].n];
+    c->mag[id].hits++;
+  } else {
+    // magazine empty: take one object for the caller,
+    // plus a batch for the magazine.
+    acquire(&c->lock);
+    p = slab_get(c);
+    for(i = 0; p && i < MAGBATCH && (q = slab_get(c)) != 0; i++)
+      c->mag[id].obj[c->mag[id].n++] = q;
+    release(&c->lock);
+  }
+  release(&c->mag[id].lock);
+  pop_off();
+  if(p)
+    return p;
+
+  // all slabs are full. grow with no locks held.
+  if((s = (struct slab*)kalloc()) == 0)
+    return 0;
+  if(c->ctor){
+    char *o = (char*)s + sizeof(struct slab);
+    for(i = 0; i < c->perslab; i++)
+      c->ctor(o + i*c->stride);
+  }
+  acquire(&c->lock);
+  slab_add(c, s);
+  p = slab_get(c);
+  release(&c->lock);
+  return p;
+}
+
+// Return an object, in its constructed state, to cache c.
+void
+kmem_cache_free(struct kmem_cache *c, void *p)
+{
+  int id;
+
+  push_off();
+  id = cpuid();
+  acquire(&c->mag[id].lock);
+  if(c->mag[id].n == MAGSIZE){
+    // magazine full: flush a batch back to the slabs.
+    acquire(&c->lock);
+    while(c->mag[id].n > MAGSIZE - MAGBATCH)
+      slab_put(c, c->mag[id].obj[--c->mag[id].n]);
+    release(&c->lock);
+  }
+  c->mag[id].obj[c->mag[id].n++] = p;
+  release(&c->mag[id].lock);
+  pop_off();
+}
+
+// Empty every magazine and free every empty slab.
+// Returns the number of pages given back to kalloc().
+int
+kmem_cache_reap(void)
+{
+  struct kmem_cache *c;
+  struct slab *s;
+  int i, n, freed;
+
+  freed = 0;
+  acquire(&kmem_caches.lock);
+  n = kmem_caches.n;
+  release(&kmem_caches.lock);
+
+  for(c = kmem_caches.cache; c < kmem_caches.cache + n; c++){
+    for(i = 0; i < NCPU; i++){
+      acquire(&c->mag[i].lock);
+      acquire(&c->lock);
+      while(c->mag[i].n > 0)
+        slab_put(c, c->mag[i].obj[--c->mag[i].n]);
+      release(&c->lock);
+      release(&c->mag[i].lock);
+    }
+    acquire(&c->lock);
+    while(!slab_isempty(&c->empty)){
+      s = c->empty.next;
+      slab_unlink(s);
+      c->nempty--;
+      c->nslab--;
+      kfree(s);
+      freed++;
+    }
+    release(&c->lock);
+  }
+  return freed;
+}
+
+void
+kmem_cache_init(void)
+{
+  initlock(&kmem_caches.lock, "kmem_caches");
+}
+
+// Print usage and magazine hit rate of every cache.
+// For debugging; runs when user types ^P on console.
+// No lock to avoid wedging a stuck machine further.
+void
+kmem_cache_dump(void)
+{
+  struct kmem_cache *c;
+  uint64 allocs, hits;
+  int i, cached;
+
+  for(c = kmem_caches.cache; c < kmem_caches.cache + kmem_caches.n; c++){
+    allocs = hits = 0;
+    cached = 0;
+    for(i = 0; i < NCPU; i++){
+      allocs += c->mag[i].allocs;
+      hits += c->mag[i].hits;
+      cached += c->mag[i].n;
+    }
+    printf("%s: size %d slabs %d cached %d allocs %d hit %d%%\n",
+           c->name, c->size, c->nslab, cached, (int)allocs,
+           allocs ? (int)(hits * 100 / allocs) : 0);
+  }
+}
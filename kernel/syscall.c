@@ -101,6 +101,11 @@ extern uint64 sys_unlink(void);
 extern uint64 sys_link(void);
 extern uint64 sys_mkdir(void);
 extern uint64 sys_close(void);
+extern uint64 sys_fsync(void);
+extern uint64 sys_splice(void);
+extern uint64 sys_fcntl(void);
+extern uint64 sys_nice(void);
+extern uint64 sys_setpriority(void);
 
 // An array mapping syscall numbers from syscall.h
 // to the function that handles the system call.
@@ -126,6 +131,11 @@ static uint64 (*syscalls[])(void) = {
 [SYS_link]    sys_link,
 [SYS_mkdir]   sys_mkdir,
 [SYS_close]   sys_close,
+[SYS_fsync]   sys_fsync,
+[SYS_splice]  sys_splice,
+[SYS_fcntl]   sys_fcntl,
+[SYS_nice]    sys_nice,
+[SYS_setpriority] sys_setpriority,
 };
 
 void
@@ -119,26 +119,72 @@ sys_fstat(void)
   return filestat(f, st);
 }
 
+uint64
+sys_fsync(void)
+{
+  struct file *f;
+
+  if(argfd(0, 0, &f) < 0)
+    return -1;
+  return filesync(f);
+}
+
+// Move up to n bytes from fd in to fd out within the kernel.
+// One of them must be a pipe, or both regular files.
+uint64
+sys_splice(void)
+{
+  struct file *in, *out;
+  int n;
+
+  argint(2, &n);
+  if(argfd(0, 0, &in) < 0 || argfd(1, 0, &out) < 0)
+    return -1;
+  return filesplice(in, out, n);
+}
+
+uint64
+sys_fcntl(void)
+{
+  struct file *f;
+  int cmd, arg;
+
+  argint(1, &cmd);
+  argint(2, &arg);
+  if(argfd(0, 0, &f) < 0)
+    return -1;
+  if(f->type != FD_PIPE)
+    return -1;
+  switch(cmd){
+  case F_GETPIPE_SZ:
+    return pipegetsize(f->pipe);
+  case F_SETPIPE_SZ:
+    return pipesetsize(f->pipe, arg);
+  }
+  return -1;
+}
+
 // Create the path new as a link to the same inode as old.
 uint64
 sys_link(void)
 {
   char name[DIRSIZ], new[MAXPATH], old[MAXPATH];
   struct inode *dp, *ip;
+  int nres = dirop_blocks();
 
   if(argstr(0, old, MAXPATH) < 0 || argstr(1, new, MAXPATH) < 0)
     return -1;
 
-  begin_op();
+  begin_opn(nres);
   if((ip = namei(old)) == 0){
-    end_op();
+    end_opn(nres);
     return -1;
   }
 
   ilock(ip);
   if(ip->type == T_DIR){
     iunlockput(ip);
-    end_op();
+    end_opn(nres);
     return -1;
   }
 
@@ -156,7 +202,7 @@ sys_link(void)
   iunlockput(dp);
   iput(ip);
 
-  end_op();
+  end_opn(nres);
 
   return 0;
 
@@ -165,7 +211,7 @@ bad:
   ip->nlink--;
   iupdate(ip);
   iunlockput(ip);
-  end_op();
+  end_opn(nres);
   return -1;
 }
 
@@ -222,6 +268,7 @@ sys_unlink(void)
   memset(&de, 0, sizeof(de));
   if(writei(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
     panic("unlink: writei");
+  dcache_remove(dp->dev, dp->inum, name);
   if(ip->type == T_DIR){
     dp->nlink--;
     iupdate(dp);
@@ -309,35 +356,37 @@ sys_open(void)
   struct file *f;
   struct inode *ip;
   int n;
+  int nres;
 
   argint(1, &omode);
   if((n = argstr(0, path, MAXPATH)) < 0)
     return -1;
 
-  begin_op();
+  nres = (omode & O_CREATE) ? dirop_blocks() : MAXOPBLOCKS;
+  begin_opn(nres);
 
   if(omode & O_CREATE){
     ip = create(path, T_FILE, 0, 0);
     if(ip == 0){
-      end_op();
+      end_opn(nres);
       return -1;
     }
   } else {
     if((ip = namei(path)) == 0){
-      end_op();
+      end_opn(nres);
       return -1;
     }
     ilock(ip);
     if(ip->type == T_DIR && omode != O_RDONLY){
       iunlockput(ip);
-      end_op();
+      end_opn(nres);
       return -1;
     }
   }
 
   if(ip->type == T_DEVICE && (ip->major < 0 || ip->major >= NDEV)){
     iunlockput(ip);
-    end_op();
+    end_opn(nres);
     return -1;
   }
 
@@ -345,7 +394,7 @@ sys_open(void)
     if(f)
       fileclose(f);
     iunlockput(ip);
-    end_op();
+    end_opn(nres);
     return -1;
   }
 
@@ -365,7 +414,7 @@ sys_open(void)
   }
 
   iunlock(ip);
-  end_op();
+  end_opn(nres);
 
   return fd;
 }
@@ -375,14 +424,15 @@ sys_mkdir(void)
 {
   char path[MAXPATH];
   struct inode *ip;
+  int nres = dirop_blocks();
 
-  begin_op();
+  begin_opn(nres);
   if(argstr(0, path, MAXPATH) < 0 || (ip = create(path, T_DIR, 0, 0)) == 0){
-    end_op();
+    end_opn(nres);
     return -1;
   }
   iunlockput(ip);
-  end_op();
+  end_opn(nres);
   return 0;
 }
 
@@ -392,17 +442,18 @@ sys_mknod(void)
   struct inode *ip;
   char path[MAXPATH];
   int major, minor;
+  int nres = dirop_blocks();
 
-  begin_op();
+  begin_opn(nres);
   argint(1, &major);
   argint(2, &minor);
   if((argstr(0, path, MAXPATH)) < 0 ||
      (ip = create(path, T_DEVICE, major, minor)) == 0){
-    end_op();
+    end_opn(nres);
     return -1;
   }
   iunlockput(ip);
-  end_op();
+  end_opn(nres);
   return 0;
 }
 
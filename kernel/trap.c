@@ -16,6 +16,9 @@ void kernelvec();
 
 extern int devintr();
 
+// in start.c; timer_scratch[hart][5] is set by each tick.
+extern uint64 timer_scratch[NCPU][7];
+
 void
 trapinit(void)
 {
@@ -67,6 +70,8 @@ usertrap(void)
     syscall();
   } else if((which_dev = devintr()) != 0){
     // ok
+  } else if(r_scause() == 15 && uvmcow(p->pagetable, PGROUNDDOWN(r_stval())) == 0){
+    // store to a copy-on-write page
   } else {
     printf("usertrap(): unexpected scause %p pid=%d\n", r_scause(), p->pid);
     printf("            sepc=%p stval=%p\n", r_sepc(), r_stval());
@@ -203,15 +208,20 @@ devintr()
     return 1;
   } else if(scause == 0x8000000000000001L){
     // software interrupt from a machine-mode timer interrupt,
-    // forwarded by timervec in kernelvec.S.
+    // or from another hart's kick(), forwarded by timervec in
+    // kernelvec.S.
+
+    // acknowledge the software interrupt by clearing
+    // the SSIP bit in sip, before seeing whether it was a tick,
+    // so that one arriving meanwhile raises it again.
+    w_sip(r_sip() & ~2);
+
+    if(__sync_lock_test_and_set(&timer_scratch[cpuid()][5], 0) == 0)
+      return 1;  // only a kick
 
     if(cpuid() == 0){
       clockintr();
     }
-    
-    // acknowledge the software interrupt by clearing
-    // the SSIP bit in sip.
-    w_sip(r_sip() & ~2);
 
     return 2;
   } else {
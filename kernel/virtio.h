@@ -47,7 +47,11 @@
 
 // this many virtio descriptors.
 // must be a power of two.
-#define NUM 8
+// a request takes two plus one per block.
+#define NUM 32
+
+// most data descriptors (blocks) in one request.
+#define MAXSEG 8
 
 // a single descriptor, from the spec.
 struct virtq_desc {
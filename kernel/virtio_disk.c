@@ -46,7 +46,7 @@ static struct disk {
   // for use when completion interrupt arrives.
   // indexed by first descriptor index of chain.
   struct {
-    struct buf *b;
+    struct buf *b;     // first buf; the rest linked by qnext
     char status;
   } info[NUM];
 
@@ -178,7 +178,6 @@ free_desc(int i)
   disk.desc[i].flags = 0;
   disk.desc[i].next = 0;
   disk.free[i] = 1;
-  wakeup(&disk.free[0]);
 }
 
 // free a chain of descriptors.
@@ -196,12 +195,11 @@ free_chain(int i)
   }
 }
 
-// allocate three descriptors (they need not be contiguous).
-// disk transfers always use three descriptors.
+// allocate n descriptors (they need not be contiguous).
 static int
-alloc3_desc(int *idx)
+alloc_descs(int *idx, int n)
 {
-  for(int i = 0; i < 3; i++){
+  for(int i = 0; i < n; i++){
     idx[i] = alloc_desc();
     if(idx[i] < 0){
       for(int j = 0; j < i; j++)
@@ -212,27 +210,37 @@ alloc3_desc(int *idx)
   return 0;
 }
 
-void
-virtio_disk_rw(struct buf *b, int write)
+// Start a read or write of n bufs for consecutive blocks,
+// linked through b->qnext from b, as one request. Does not wait
+// for it to finish: virtio_disk_intr() clears b->disk of each
+// buf when the device is done with it, marks it valid if it was
+// a read, and wakes up sleepers on it.
+// Returns -1, having done nothing, if there are not enough free
+// descriptors; the I/O scheduler retries once requests complete.
+int
+virtio_disk_start(struct buf *b, int n, int write)
 {
   uint64 sector = b->blockno * (BSIZE / 512);
+  int idx[MAXSEG+2];
+  struct buf *x;
+  int i;
 
-  acquire(&disk.vdisk_lock);
+  if(n < 1 || n > MAXSEG)
+    panic("virtio_disk_start");
 
-  // the spec's Section 5.2 says that legacy block operations use
-  // three descriptors: one for type/reserved/sector, one for the
-  // data, one for a 1-byte status result.
+  acquire(&disk.vdisk_lock);
 
-  // allocate the three descriptors.
-  int idx[3];
-  while(1){
-    if(alloc3_desc(idx) == 0) {
-      break;
-    }
-    sleep(&disk.free[0], &disk.vdisk_lock);
+  // the spec's Section 5.2 says that block operations use a
+  // chain of descriptors: one for type/reserved/sector, one
+  // or more for the data, one for a 1-byte status result.
+  // the data descriptors form a scatter/gather list, so one
+  // request can cover several bufs for adjacent blocks.
+  if(alloc_descs(idx, n+2) != 0){
+    release(&disk.vdisk_lock);
+    return -1;
   }
 
-  // format the three descriptors.
+  // format the descriptors.
   // qemu's virtio-blk.c reads them.
 
   struct virtio_blk_req *buf0 = &disk.ops[idx[0]];
@@ -249,23 +257,24 @@ virtio_disk_rw(struct buf *b, int write)
   disk.desc[idx[0]].flags = VRING_DESC_F_NEXT;
   disk.desc[idx[0]].next = idx[1];
 
-  disk.desc[idx[1]].addr = (uint64) b->data;
-  disk.desc[idx[1]].len = BSIZE;
-  if(write)
-    disk.desc[idx[1]].flags = 0; // device reads b->data
-  else
-    disk.desc[idx[1]].flags = VRING_DESC_F_WRITE; // device writes b->data
-  disk.desc[idx[1]].flags |= VRING_DESC_F_NEXT;
-  disk.desc[idx[1]].next = idx[2];
+  for(i = 1, x = b; i <= n; i++, x = x->qnext){
+    disk.desc[idx[i]].addr = (uint64) x->data;
+    disk.desc[idx[i]].len = BSIZE;
+    if(write)
+      disk.desc[idx[i]].flags = 0; // device reads x->data
+    else
+      disk.desc[idx[i]].flags = VRING_DESC_F_WRITE; // device writes x->data
+    disk.desc[idx[i]].flags |= VRING_DESC_F_NEXT;
+    disk.desc[idx[i]].next = idx[i+1];
+  }
 
   disk.info[idx[0]].status = 0xff; // device writes 0 on success
-  disk.desc[idx[2]].addr = (uint64) &disk.info[idx[0]].status;
-  disk.desc[idx[2]].len = 1;
-  disk.desc[idx[2]].flags = VRING_DESC_F_WRITE; // device writes the status
-  disk.desc[idx[2]].next = 0;
+  disk.desc[idx[n+1]].addr = (uint64) &disk.info[idx[0]].status;
+  disk.desc[idx[n+1]].len = 1;
+  disk.desc[idx[n+1]].flags = VRING_DESC_F_WRITE; // device writes the status
+  disk.desc[idx[n+1]].next = 0;
 
-  // record struct buf for virtio_disk_intr().
-  b->disk = 1;
+  // record the bufs for virtio_disk_intr().
   disk.info[idx[0]].b = b;
 
   // tell the device the first index in our chain of descriptors.
@@ -280,14 +289,19 @@ virtio_disk_rw(struct buf *b, int write)
 
   *R(VIRTIO_MMIO_QUEUE_NOTIFY) = 0; // value is queue number
 
-  // Wait for virtio_disk_intr() to say request has finished.
+  release(&disk.vdisk_lock);
+  return 0;
+}
+
+// Wait for virtio_disk_intr() to say a started request
+// for b has finished.
+void
+virtio_disk_wait(struct buf *b)
+{
+  acquire(&disk.vdisk_lock);
   while(b->disk == 1) {
     sleep(b, &disk.vdisk_lock);
   }
-
-  disk.info[idx[0]].b = 0;
-  free_chain(idx[0]);
-
   release(&disk.vdisk_lock);
 }
 
@@ -307,8 +321,10 @@ virtio_disk_intr()
   __sync_synchronize();
 
   // the device increments disk.used->idx when it
-  // adds an entry to the used ring.
+  // adds an entry to the used ring. drain every entry
+  // that has arrived, however many requests that is.
 
+  int done = 0;
   while(disk.used_idx != disk.used->idx){
     __sync_synchronize();
     int id = disk.used->ring[disk.used_idx % NUM].id;
@@ -316,12 +332,25 @@ virtio_disk_intr()
     if(disk.info[id].status != 0)
       panic("virtio_disk_intr status");
 
-    struct buf *b = disk.info[id].b;
-    b->disk = 0;   // disk is done with buf
-    wakeup(b);
+    struct buf *b, *next;
+    for(b = disk.info[id].b; b; b = next){
+      // once b->disk is clear, b may be recycled.
+      next = b->qnext;
+      if(disk.ops[id].type == VIRTIO_BLK_T_IN)
+        b->valid = 1;
+      b->disk = 0;   // disk is done with buf
+      wakeup(b);
+    }
+    disk.info[id].b = 0;
+    free_chain(id);
 
     disk.used_idx += 1;
+    done++;
   }
 
   release(&disk.vdisk_lock);
+
+  // descriptors were freed; start more queued requests.
+  if(done)
+    iosched_dispatch();
 }
@@ -6,6 +6,7 @@
 #include <assert.h>
 
 #define stat xv6_stat  // avoid clash with host struct stat
+#define BSIZE bsize   // chosen with -B
 #include "kernel/types.h"
 #include "kernel/fs.h"
 #include "kernel/stat.h"
@@ -20,15 +21,21 @@
 // Disk layout:
 // [ boot block | sb block | log | inode blocks | free bit map | data blocks ]
 
-int nbitmap = FSSIZE/(BSIZE*8) + 1;
-int ninodeblocks = NINODES / IPB + 1;
-int nlog = LOGSIZE;
+int bsize = DEFBSIZE;
+int fssize = FSSIZE;
+int nbitmap;
+int ninodeblocks;
+int nboot;    // Number of blocks holding the boot block and sb
+int nlog = LOGBLOCKS;
+int extents = 1;  // extent-mapped inodes (else block-mapped)
+int hashdirs = 1; // hashed directories (else linear)
+int inlined = 1;  // small files' data in their inode
 int nmeta;    // Number of meta blocks (boot, sb, nlog, inode, bitmap)
 int nblocks;  // Number of data blocks
 
 int fsfd;
 struct superblock sb;
-char zeroes[BSIZE];
+char zeroes[MAXBSIZE];
 uint freeinode = 1;
 uint freeblock;
 
@@ -40,7 +47,10 @@ void rinode(uint inum, struct dinode *ip);
 void rsect(uint sec, void *buf);
 uint ialloc(ushort type);
 void iappend(uint inum, void *p, int n);
+uint ext_bmap(struct dinode *din, uint fbn);
+void hashdir(uint inum, uint parent, struct dirent *de, int n);
 void die(const char *);
+void usage(void);
 
 // convert to riscv byte order
 ushort
@@ -73,12 +83,54 @@ main(int argc, char *argv[])
   struct dirent de;
   char buf[BSIZE];
   struct dinode din;
+  struct dirent *ents;
+  int nents;
 
 
   static_assert(sizeof(int) == 4, "Integers must be 4 bytes!");
 
-  if(argc < 2){
-    fprintf(stderr, "Usage: mkfs fs.img files...\n");
+  while((i = getopt(argc, argv, "s:l:B:bdn")) != -1){
+    switch(i){
+    case 'B':
+      bsize = atoi(optarg);
+      break;
+    case 'b':
+      extents = 0;
+      break;
+    case 'd':
+      hashdirs = 0;
+      break;
+    case 'n':
+      inlined = 0;
+      break;
+    case 's':
+      fssize = atoi(optarg);
+      break;
+    case 'l':
+      nlog = atoi(optarg);
+      break;
+    default:
+      usage();
+    }
+  }
+  argc -= optind - 1;
+  argv += optind - 1;
+  if(argc < 2)
+    usage();
+  if(bsize < DEFBSIZE || bsize > MAXBSIZE || (bsize & (bsize - 1))){
+    fprintf(stderr, "mkfs: block size must be a power of 2 from %d to %d\n",
+            DEFBSIZE, MAXBSIZE);
+    exit(1);
+  }
+  if(nlog < MAXOPBLOCKS + 3){
+    fprintf(stderr, "mkfs: log must be at least %d blocks\n", MAXOPBLOCKS + 3);
+    exit(1);
+  }
+  // the kernel lets one FS call reserve half a transaction, and
+  // one that adds to a hashed directory needs DIROPBLOCKS.
+  if(hashdirs && nlog < 2*DIROPBLOCKS + 3){
+    fprintf(stderr, "mkfs: log must be at least %d blocks with hashed "
+            "directories (or use -d)\n", 2*DIROPBLOCKS + 3);
     exit(1);
   }
 
@@ -89,43 +141,57 @@ main(int argc, char *argv[])
   if(fsfd < 0)
     die(argv[1]);
 
-  // 1 fs block = 1 disk sector
-  nmeta = 2 + nlog + ninodeblocks + nbitmap;
-  nblocks = FSSIZE - nmeta;
+  // the super block is the DEFBSIZE bytes from SBOFF on.
+  nboot = (SBOFF + DEFBSIZE + BSIZE - 1) / BSIZE;
+  ninodeblocks = NINODES / IPB + 1;
+  nbitmap = fssize/(BSIZE*8) + 1;
+  nmeta = nboot + nlog + ninodeblocks + nbitmap;
+  if(nmeta >= fssize){
+    fprintf(stderr, "mkfs: %d blocks is too small\n", fssize);
+    exit(1);
+  }
+  nblocks = fssize - nmeta;
 
   sb.magic = FSMAGIC;
-  sb.size = xint(FSSIZE);
+  sb.size = xint(fssize);
   sb.nblocks = xint(nblocks);
   sb.ninodes = xint(NINODES);
   sb.nlog = xint(nlog);
-  sb.logstart = xint(2);
-  sb.inodestart = xint(2+nlog);
-  sb.bmapstart = xint(2+nlog+ninodeblocks);
+  sb.logstart = xint(nboot);
+  sb.inodestart = xint(nboot+nlog);
+  sb.bmapstart = xint(nboot+nlog+ninodeblocks);
+  sb.features = xint((extents ? FS_EXTENTS : 0) | (hashdirs ? FS_HASHDIR : 0) |
+                     (inlined ? FS_INLINE : 0));
+  sb.bsize = xint(bsize);
 
-  printf("nmeta %d (boot, super, log blocks %u inode blocks %u, bitmap blocks %u) blocks %d total %d\n",
-         nmeta, nlog, ninodeblocks, nbitmap, nblocks, FSSIZE);
+  printf("nmeta %d (boot, super, log blocks %u inode blocks %u, bitmap blocks %u) blocks %d total %d, %d-byte blocks\n",
+         nmeta, nlog, ninodeblocks, nbitmap, nblocks, fssize, bsize);
 
   freeblock = nmeta;     // the first free block that we can allocate
 
-  for(i = 0; i < FSSIZE; i++)
+  for(i = 0; i < fssize; i++)
     wsect(i, zeroes);
 
-  memset(buf, 0, sizeof(buf));
-  memmove(buf, &sb, sizeof(sb));
-  wsect(1, buf);
+  if(lseek(fsfd, SBOFF, 0) != SBOFF || write(fsfd, &sb, sizeof(sb)) != sizeof(sb))
+    die("write super block");
 
   rootino = ialloc(T_DIR);
   assert(rootino == ROOTINO);
 
-  bzero(&de, sizeof(de));
-  de.inum = xshort(rootino);
-  strcpy(de.name, ".");
-  iappend(rootino, &de, sizeof(de));
+  // a hashed root is written once all its entries are known.
+  ents = calloc(argc, sizeof(struct dirent));
+  nents = 0;
+  if(!hashdirs){
+    bzero(&de, sizeof(de));
+    de.inum = xshort(rootino);
+    strcpy(de.name, ".");
+    iappend(rootino, &de, sizeof(de));
 
-  bzero(&de, sizeof(de));
-  de.inum = xshort(rootino);
-  strcpy(de.name, "..");
-  iappend(rootino, &de, sizeof(de));
+    bzero(&de, sizeof(de));
+    de.inum = xshort(rootino);
+    strcpy(de.name, "..");
+    iappend(rootino, &de, sizeof(de));
+  }
 
   for(i = 2; i < argc; i++){
     // get rid of "user/"
@@ -152,7 +218,10 @@ main(int argc, char *argv[])
     bzero(&de, sizeof(de));
     de.inum = xshort(inum);
     strncpy(de.name, shortname, DIRSIZ);
-    iappend(rootino, &de, sizeof(de));
+    if(hashdirs)
+      ents[nents++] = de;
+    else
+      iappend(rootino, &de, sizeof(de));
 
     while((cc = read(fd, buf, sizeof(buf))) > 0)
       iappend(inum, buf, cc);
@@ -160,12 +229,16 @@ main(int argc, char *argv[])
     close(fd);
   }
 
-  // fix size of root inode dir
-  rinode(rootino, &din);
-  off = xint(din.size);
-  off = ((off/BSIZE) + 1) * BSIZE;
-  din.size = xint(off);
-  winode(rootino, &din);
+  if(hashdirs){
+    hashdir(rootino, rootino, ents, nents);
+  } else {
+    // fix size of root inode dir
+    rinode(rootino, &din);
+    off = xint(din.size);
+    off = ((off/BSIZE) + 1) * BSIZE;
+    din.size = xint(off);
+    winode(rootino, &din);
+  }
 
   balloc(freeblock);
 
@@ -227,6 +300,11 @@ ialloc(ushort type)
   din.type = xshort(type);
   din.nlink = xshort(1);
   din.size = xint(0);
+  if(type == T_FILE && inlined)
+    din.flags = xint(DI_INLINE);
+  else
+    din.flags = xint((extents ? DI_EXTENTS : 0) |
+                     (type == T_DIR && hashdirs ? DI_HASHDIR : 0));
   winode(inum, &din);
   return inum;
 }
@@ -235,16 +313,18 @@ void
 balloc(int used)
 {
   uchar buf[BSIZE];
-  int i;
+  int i, b;
 
   printf("balloc: first %d blocks have been allocated\n", used);
-  assert(used < BSIZE*8);
-  bzero(buf, BSIZE);
-  for(i = 0; i < used; i++){
-    buf[i/8] = buf[i/8] | (0x1 << (i%8));
+  assert(used <= fssize);
+  for(b = 0; b * BSIZE*8 < used; b++){
+    bzero(buf, BSIZE);
+    for(i = 0; i < BSIZE*8 && b*BSIZE*8 + i < used; i++){
+      buf[i/8] = buf[i/8] | (0x1 << (i%8));
+    }
+    printf("balloc: write bitmap block at sector %d\n", xint(sb.bmapstart)+b);
+    wsect(xint(sb.bmapstart)+b, buf);
   }
-  printf("balloc: write bitmap block at sector %d\n", sb.bmapstart);
-  wsect(sb.bmapstart, buf);
 }
 
 #define min(a, b) ((a) < (b) ? (a) : (b))
@@ -257,29 +337,62 @@ iappend(uint inum, void *xp, int n)
   struct dinode din;
   char buf[BSIZE];
   uint indirect[NINDIRECT];
-  uint x;
+  uint x, bn, i;
+  unsigned long span;
+  int level;
 
   rinode(inum, &din);
   off = xint(din.size);
   // printf("append inum %d at off %d sz %d\n", inum, off, n);
+  if(xint(din.flags) & DI_INLINE){
+    if(off + n <= NINLINE){
+      memmove((char*)din.addrs + off, p, n);
+      din.size = xint(off + n);
+      winode(inum, &din);
+      return;
+    }
+    // too big: move the data to blocks.
+    memmove(buf, din.addrs, off);
+    memset(din.addrs, 0, sizeof(din.addrs));
+    din.flags = xint(extents ? DI_EXTENTS : 0);
+    din.size = 0;
+    winode(inum, &din);
+    iappend(inum, buf, off);
+    iappend(inum, p, n);
+    return;
+  }
   while(n > 0){
     fbn = off / BSIZE;
-    assert(fbn < MAXFILE);
-    if(fbn < NDIRECT){
+    if(xint(din.flags) & DI_EXTENTS){
+      x = ext_bmap(&din, fbn);
+    } else if(fbn < NDIRECT){
       if(xint(din.addrs[fbn]) == 0){
         din.addrs[fbn] = xint(freeblock++);
       }
       x = xint(din.addrs[fbn]);
     } else {
-      if(xint(din.addrs[NDIRECT]) == 0){
-        din.addrs[NDIRECT] = xint(freeblock++);
+      assert(fbn < MAXFILE);
+      // singly, doubly or triply indirect?
+      bn = fbn - NDIRECT;
+      for(level = 1, span = NINDIRECT; bn >= span; level++){
+        bn -= span;
+        span *= NINDIRECT;
       }
-      rsect(xint(din.addrs[NDIRECT]), (char*)indirect);
-      if(indirect[fbn - NDIRECT] == 0){
-        indirect[fbn - NDIRECT] = xint(freeblock++);
-        wsect(xint(din.addrs[NDIRECT]), (char*)indirect);
+      if(xint(din.addrs[NDIRECT+level-1]) == 0){
+        din.addrs[NDIRECT+level-1] = xint(freeblock++);
+      }
+      x = xint(din.addrs[NDIRECT+level-1]);
+      for(span /= NINDIRECT; ; span /= NINDIRECT){
+        rsect(x, (char*)indirect);
+        i = bn / span % NINDIRECT;
+        if(indirect[i] == 0){
+          indirect[i] = xint(freeblock++);
+          wsect(x, (char*)indirect);
+        }
+        x = xint(indirect[i]);
+        if(span == 1)
+          break;
       }
-      x = xint(indirect[fbn-NDIRECT]);
     }
     n1 = min(n, (fbn + 1) * BSIZE - off);
     rsect(x, buf);
@@ -293,6 +406,154 @@ iappend(uint inum, void *xp, int n)
   winode(inum, &din);
 }
 
+// Return the disk block of block fbn of an extent-mapped inode,
+// which must be either its last block or the one after it; in
+// that case allocate it. mkfs only builds trees of depth 0 or 1.
+uint
+ext_bmap(struct dinode *din, uint fbn)
+{
+  struct exthdr *root = (struct exthdr*)din->addrs;
+  struct extent *re = (struct extent*)(root + 1);
+  struct exthdr *h;
+  struct extent *e, *last;
+  char leaf[BSIZE];
+  uint lb, b;
+  int n;
+
+  lb = 0;
+  h = root;
+  if(xshort(root->depth) > 0){
+    assert(xshort(root->depth) == 1);
+    lb = xint(re[xshort(root->n) - 1].pblk);
+    rsect(lb, leaf);
+    h = (struct exthdr*)leaf;
+  }
+  e = (struct extent*)(h + 1);
+  n = xshort(h->n);
+  last = n > 0 ? &e[n-1] : 0;
+  if(last && fbn - xint(last->lblk) < xint(last->len))
+    return xint(last->pblk) + fbn - xint(last->lblk);
+  assert(last == 0 || fbn == xint(last->lblk) + xint(last->len));
+
+  b = freeblock++;
+  if(last && b == xint(last->pblk) + xint(last->len)){
+    last->len = xint(xint(last->len) + 1);
+  } else if(n < (lb ? NEXTNODE : NEXTROOT)){
+    e[n].lblk = xint(fbn);
+    e[n].pblk = xint(b);
+    e[n].len = xint(1);
+    h->n = xshort(n + 1);
+  } else if(lb == 0){
+    // root is full: move its extents to a leaf below it.
+    lb = freeblock++;
+    bzero(leaf, BSIZE);
+    memmove(leaf, root, sizeof(*root) + n * sizeof(*e));
+    h = (struct exthdr*)leaf;
+    e = (struct extent*)(h + 1);
+    e[n].lblk = xint(fbn);
+    e[n].pblk = xint(b);
+    e[n].len = xint(1);
+    h->n = xshort(n + 1);
+    root->depth = xshort(1);
+    root->n = xshort(1);
+    re[0].pblk = xint(lb);
+    re[0].len = 0;
+  } else {
+    // leaf is full: start another one.
+    assert(xshort(root->n) < NEXTROOT);
+    lb = freeblock++;
+    bzero(leaf, BSIZE);
+    h = (struct exthdr*)leaf;
+    e = (struct extent*)(h + 1);
+    e[0].lblk = xint(fbn);
+    e[0].pblk = xint(b);
+    e[0].len = xint(1);
+    h->n = xshort(1);
+    n = xshort(root->n);
+    re[n].lblk = xint(fbn);
+    re[n].pblk = xint(lb);
+    re[n].len = 0;
+    root->n = xshort(n + 1);
+  }
+  if(lb)
+    wsect(lb, leaf);
+  return b;
+}
+
+uint
+dirhash(char *name)
+{
+  uint h = 2166136261;  // FNV-1a, as in the kernel
+  int i;
+
+  for(i = 0; i < DIRSIZ && name[i]; i++)
+    h = (h ^ (uchar)name[i]) * 16777619;
+  return h;
+}
+
+// Write the n entries in de, plus "." and "..", to the empty
+// directory inum as a hashed directory, with a table just deep
+// enough that no bucket needs chaining.
+void
+hashdir(uint inum, uint parent, struct dirent *de, int n)
+{
+  struct dirent blk[BSIZE / sizeof(struct dirent)];
+  struct dirhdr *h;
+  int cnt[1 << DIRMAXDEPTH];
+  int depth, nb, i, b, k, full;
+  ushort *tab;
+
+  for(depth = 0; ; depth++){
+    if(depth > DIRMAXDEPTH){
+      fprintf(stderr, "mkfs: too many entries for a hashed directory\n");
+      exit(1);
+    }
+    nb = 1 << depth;
+    memset(cnt, 0, sizeof(cnt));
+    full = 0;
+    for(i = 0; i < n; i++)
+      if(++cnt[dirhash(de[i].name) & (nb - 1)] >= BSIZE / sizeof(struct dirent))
+        full = 1;
+    if(!full)
+      break;
+  }
+
+  // block 0: ".", "..", the header and the table.
+  bzero(blk, BSIZE);
+  blk[0].inum = xshort(inum);
+  strcpy(blk[0].name, ".");
+  blk[1].inum = xshort(parent);
+  strcpy(blk[1].name, "..");
+  h = (struct dirhdr*)&blk[DIRHDR];
+  h->magic = xshort(DIRMAGIC);
+  h->depth = xshort(depth);
+  for(i = 0; i < nb; i++){
+    tab = (ushort*)blk[DIRTAB + i / DIRTABPER].name;
+    tab[i % DIRTABPER] = xshort(1 + i);
+  }
+  iappend(inum, blk, BSIZE);
+
+  // then one block per bucket.
+  for(b = 0; b < nb; b++){
+    bzero(blk, BSIZE);
+    h = (struct dirhdr*)&blk[0];
+    h->magic = xshort(DIRMAGIC);
+    h->depth = xshort(depth);
+    k = 1;
+    for(i = 0; i < n; i++)
+      if((dirhash(de[i].name) & (nb - 1)) == b)
+        blk[k++] = de[i];
+    iappend(inum, blk, BSIZE);
+  }
+}
+
+void
+usage(void)
+{
+  fprintf(stderr, "Usage: mkfs [-s fssize] [-l logsize] [-B bsize] [-b] [-d] [-n] fs.img files...\n");
+  exit(1);
+}
+
 void
 die(const char *s)
 {
@@ -22,6 +22,11 @@ int getpid(void);
 char* sbrk(int);
 int sleep(int);
 int uptime(void);
+int fsync(int);
+int splice(int, int, int);
+int fcntl(int, int, int);
+int nice(int);
+int setpriority(int, int);
 
 // ulib.c
 int stat(const char*, struct stat*);
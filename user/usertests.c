@@ -575,6 +575,9 @@ writetest(char *s)
   }
 }
 
+// big enough to need a doubly-indirect block, if block-mapped.
+#define BIGFILE (NDIRECT + 3*NINDIRECT)
+
 void
 writebig(char *s)
 {
@@ -586,7 +589,7 @@ writebig(char *s)
     exit(1);
   }
 
-  for(i = 0; i < MAXFILE; i++){
+  for(i = 0; i < BIGFILE; i++){
     ((int*)buf)[0] = i;
     if(write(fd, buf, BSIZE) != BSIZE){
       printf("%s: error: write big file failed\n", s, i);
@@ -606,7 +609,7 @@ writebig(char *s)
   for(;;){
     i = read(fd, buf, BSIZE);
     if(i == 0){
-      if(n == MAXFILE - 1){
+      if(n != BIGFILE){
         printf("%s: read only %d blocks from big", s, n);
         exit(1);
       }
@@ -786,6 +789,145 @@ pipe1(char *s)
 }
 
 
+// move NPAGE pages through a pipe in msg-byte writes and reads,
+// from and to page-aligned buffers, checking every word.
+// returns the ticks it took.
+static int
+pipexfer(char *s, char *wb, char *rb, int msg)
+{
+  enum { NPAGE = 1024 };
+  int fds[2], pid, xstatus, t0, i, j, n, cc, total;
+  uint *w = (uint*)wb, *r = (uint*)rb;
+
+  if(pipe(fds) != 0){
+    printf("%s: pipe() failed\n", s);
+    exit(1);
+  }
+  t0 = uptime();
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork() failed\n", s);
+    exit(1);
+  }
+  total = NPAGE * PGSIZE / msg;
+  if(pid == 0){
+    close(fds[0]);
+    // refill the buffer for every message: if its page went
+    // into the pipe without a copy, this must copy it first.
+    for(i = 0; i < total; i++){
+      for(j = 0; j < msg/sizeof(uint); j++)
+        w[j] = i * msg + j;
+      if(write(fds[1], wb, msg) != msg){
+        printf("%s: pipe write failed\n", s);
+        exit(1);
+      }
+    }
+    exit(0);
+  }
+  close(fds[1]);
+  for(i = 0; i < total; i++){
+    for(n = 0; n < msg; n += cc){
+      if((cc = read(fds[0], rb + n, msg - n)) <= 0){
+        printf("%s: pipe read failed\n", s);
+        exit(1);
+      }
+    }
+    for(j = 0; j < msg/sizeof(uint); j++){
+      if(r[j] != i * msg + j){
+        printf("%s: message %d word %d is %d\n", s, i, j, r[j]);
+        exit(1);
+      }
+    }
+  }
+  if(read(fds[0], rb, 1) != 0){
+    printf("%s: data after the end\n", s);
+    exit(1);
+  }
+  close(fds[0]);
+  wait(&xstatus);
+  if(xstatus != 0)
+    exit(xstatus);
+  return uptime() - t0;
+}
+
+// pipe throughput: page-sized, page-aligned messages, which the
+// kernel flips rather than copies, against small ones.
+void
+pipethroughput(char *s)
+{
+  char *p, *wb, *rb;
+  int big, small;
+
+  p = sbrk(3*PGSIZE);
+  if(p == (char*)-1){
+    printf("%s: sbrk failed\n", s);
+    exit(1);
+  }
+  wb = (char*)PGROUNDUP((uint64)p);
+  rb = wb + PGSIZE;
+
+  big = pipexfer(s, wb, rb, PGSIZE);
+  small = pipexfer(s, wb, rb, 512);
+  printf("%s: 4MB in pages %d ticks, in 512-byte messages %d ticks\n",
+         s, big, small);
+}
+
+// several writers blocked on a full pipe: one read makes room
+// for all of them, and must get them all going even though the
+// reader then waits for them to exit without reading more.
+void
+pipewriters(char *s)
+{
+  enum { NW = 4, MSG = 100 };
+  int fds[2], i, n, pid, xstatus;
+  static char b[PGSIZE];
+
+  if(pipe(fds) != 0){
+    printf("%s: pipe() failed\n", s);
+    exit(1);
+  }
+  if(fcntl(fds[1], F_SETPIPE_SZ, PGSIZE) != PGSIZE){
+    printf("%s: F_SETPIPE_SZ failed\n", s);
+    exit(1);
+  }
+  memset(b, 'x', sizeof(b));
+  if(write(fds[1], b, PGSIZE) != PGSIZE){
+    printf("%s: fill failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < NW; i++){
+    pid = fork();
+    if(pid < 0){
+      printf("%s: fork failed\n", s);
+      exit(1);
+    }
+    if(pid == 0){
+      close(fds[0]);
+      exit(write(fds[1], b, MSG) == MSG ? 0 : 1);
+    }
+  }
+  close(fds[1]);
+  sleep(2);
+  for(n = 0; n < PGSIZE; n += i){
+    if((i = read(fds[0], b, PGSIZE - n)) <= 0){
+      printf("%s: read failed\n", s);
+      exit(1);
+    }
+  }
+  for(i = 0; i < NW; i++){
+    wait(&xstatus);
+    if(xstatus != 0)
+      exit(xstatus);
+  }
+  for(n = 0; (i = read(fds[0], b, sizeof(b))) > 0; n += i)
+    ;
+  if(n != NW * MSG){
+    printf("%s: read %d bytes, expected %d\n", s, n, NW * MSG);
+    exit(1);
+  }
+  close(fds[0]);
+}
+
 // test if child is killed (status = -1)
 void
 killstatus(char *s)
@@ -871,6 +1013,62 @@ preempt(char *s)
   wait(0);
 }
 
+// nice and setpriority, and a sleeper under cpu-bound
+// background load: with every cpu busy with niced spinners,
+// waking up from sleep(1) must still be prompt.
+void
+schedclass(char *s)
+{
+  enum { NHOG = 4, NSLEEP = 10 };
+  int pids[NHOG], i, t0, t;
+
+  if(nice(0) != 0){
+    printf("%s: nice(0) != 0\n", s);
+    exit(1);
+  }
+  if(nice(100) != 19 || nice(-100) != -20 || nice(20) != 0){
+    printf("%s: nice doesn't clamp\n", s);
+    exit(1);
+  }
+  if(setpriority(0, -1) != -1 || setpriority(0, 1000) != -1){
+    printf("%s: setpriority accepted a bad priority\n", s);
+    exit(1);
+  }
+  if(setpriority(0x7fffffff, 1) != -1){
+    printf("%s: setpriority of a missing pid succeeded\n", s);
+    exit(1);
+  }
+  if(setpriority(0, 1) != 0 || setpriority(getpid(), 0) != 0){
+    printf("%s: setpriority failed\n", s);
+    exit(1);
+  }
+
+  for(i = 0; i < NHOG; i++){
+    pids[i] = fork();
+    if(pids[i] < 0){
+      printf("%s: fork failed\n", s);
+      exit(1);
+    }
+    if(pids[i] == 0){
+      nice(19);
+      for(;;)
+        ;
+    }
+  }
+  t0 = uptime();
+  for(i = 0; i < NSLEEP; i++)
+    sleep(1);
+  t = uptime() - t0;
+  for(i = 0; i < NHOG; i++)
+    kill(pids[i]);
+  for(i = 0; i < NHOG; i++)
+    wait(0);
+  if(t > 3*NSLEEP){
+    printf("%s: %d sleep(1)s under load took %d ticks\n", s, NSLEEP, t);
+    exit(1);
+  }
+}
+
 // try to find any races between exit and wait
 void
 exitwait(char *s)
@@ -2594,8 +2792,11 @@ struct test {
   {dirtest, "dirtest"},
   {exectest, "exectest"},
   {pipe1, "pipe1"},
+  {pipethroughput, "pipethroughput"},
+  {pipewriters, "pipewriters"},
   {killstatus, "killstatus"},
   {preempt, "preempt"},
+  {schedclass, "schedclass"},
   {exitwait, "exitwait"},
   {reparent, "reparent" },
   {twochildren, "twochildren"},
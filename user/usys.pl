@@ -36,3 +36,8 @@ entry("getpid");
 entry("sbrk");
 entry("sleep");
 entry("uptime");
+entry("fsync");
+entry("splice");
+entry("fcntl");
+entry("nice");
+entry("setpriority");